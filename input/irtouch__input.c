@@ -8,8 +8,21 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
 
 #define TOUCH_WIDTH_ENABLE 1
+/* assign slots by nearest-neighbour matching instead of trusting firmware ids */
+#define TOUCH_TRACKING_ENABLE 0
+#define TRACKING_MAX_DIST   4096  /* farthest a contact may move between frames */
+/* merge several panels into one device, must match USE_IRTOUCH_STITCH in irtouch__algo.c */
+#define TOUCH_STITCH_ENABLE 0
+#define STITCH_MAX_PANEL    4
+#define STITCH_MERGE_DIST   512   /* contacts closer than this across a seam are one */
+#define STITCH_FULL_SCALE   32768
+#define STITCH_STALE_MS     100   /* a panel silent this long is not waited for */
+/* run an attached eBPF program on every frame before it is reported */
+#define TOUCH_BPF_ENABLE 0
 #define PER_POINT 6
 #define MAX_POINT 20
 #if TOUCH_WIDTH_ENABLE == 1
@@ -25,6 +38,19 @@
 #define TOUCH_STATE_DN_UP   4
 #define TOUCH_STATE_MV      7
 
+/* kfuncs from modules, and fmod_ret needs the hook on the error-injection list */
+#if TOUCH_BPF_ENABLE == 1 && (!IS_ENABLED(CONFIG_BPF_SYSCALL) || \
+    !IS_ENABLED(CONFIG_FUNCTION_ERROR_INJECTION) || LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0))
+  #undef TOUCH_BPF_ENABLE
+  #define TOUCH_BPF_ENABLE 0
+#endif
+#if TOUCH_BPF_ENABLE == 1
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/error-injection.h>
+#endif
+
 #define DEBUG 0
 #if DEBUG==1
   #define DBG_PRINTK(args...) printk("irtouch-input.c[DBG]: "args)
@@ -43,15 +69,118 @@ typedef struct _IRTOUCH_TOUCH_DATA_S
 #endif
 } IRTOUCH_TOUCH_DATA_S, *PTR_IRTOUCH_TOUCH_DATA_S;
 
+#if TOUCH_BPF_ENABLE == 1
+/* the buffer irtouch_bpf_get_data() hands out, layout is part of the ABI */
+struct irtouch_bpf_frame {
+	IRTOUCH_TOUCH_DATA_S  point[MAX_POINT];
+	unsigned char         tool[MAX_POINT];   /* MT_TOOL_* each point is reported as */
+};
+
+struct irtouch_bpf_ctx {
+	struct irtouch_bpf_frame *frame;
+	unsigned int          size;              /* bytes behind frame */
+	int                   panel;             /* stitch panel, 0 without stitching */
+	s64                   time_ns;           /* scan time of the frame */
+};
+#endif
+
+#if TOUCH_STITCH_ENABLE == 1
+typedef struct _IRTOUCH_PANEL_S {
+	bool                  used;
+	bool                  fresh;             /* new frame since the last combined frame */
+	int                   pack_cnt;
+	IRTOUCH_TOUCH_DATA_S  data[MAX_POINT];   /* frame being assembled */
+	ktime_t               report_time;
+	ktime_t               seen;              /* when its last frame was stored */
+	int                   contact_cnt;       /* contacts of the last frame, global space */
+	struct input_mt_pos   pos[MAX_POINT];
+	unsigned short        major[MAX_POINT];
+	unsigned short        minor[MAX_POINT];
+	unsigned char         tool[MAX_POINT];
+	int                   x, y, w, h;        /* placement in global space */
+} IRTOUCH_PANEL_S, *PTR_IRTOUCH_PANEL_S;
+#endif
+
 typedef struct _IRTOUCH_INPUT_S {
 	struct input_dev      *ptouch_dev;
 	struct mutex          io_mutex;
 	IRTOUCH_TOUCH_DATA_S  irtouch_data[MAX_POINT];
 	int                   irtouch_pack_cnt;
+	int                   contact_cnt;       /* contacts in the last reported frame */
+	ktime_t               report_time;       /* scan time of the frame being assembled */
+	unsigned char         tool[MAX_POINT];   /* MT_TOOL_* of each point of the frame */
+#if TOUCH_BPF_ENABLE == 1
+	struct irtouch_bpf_frame bpf_frame;
+#endif
+#if TOUCH_STITCH_ENABLE == 1
+	IRTOUCH_PANEL_S       panel[STITCH_MAX_PANEL];
+#endif
 } IRTOUCH_INPUT_S, *PTR_IRTOUCH_INPUT_S;
 
 PTR_IRTOUCH_INPUT_S G_ptr_irtouch_input_dev;
+/* lifetime of the shared input device, held by every entry point using it */
+static DEFINE_MUTEX(G_irtouch_input_lock);
+static int G_irtouch_input_users;
+
+/* stamp the frame with its scan time instead of the time input_sync() runs */
+static void report_frame_time(PTR_IRTOUCH_INPUT_S pDev)
+{
+    if (ktime_to_ns(pDev->report_time) == 0)
+        return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,4,0)
+    input_set_timestamp(pDev->ptouch_dev, pDev->report_time);
+#endif
+    input_event(pDev->ptouch_dev, EV_MSC, MSC_TIMESTAMP, (u32)ktime_to_us(pDev->report_time));
+}
+
+#if TOUCH_TRACKING_ENABLE == 1
+/* slots are assigned by nearest-neighbour matching, firmware ids are ignored */
+static void report_touch_event(PTR_IRTOUCH_INPUT_S pDev, const PTR_IRTOUCH_TOUCH_DATA_S ptouch_data, int point_cnt)
+{
+	struct input_dev *ptouch_dev = pDev->ptouch_dev;
+    struct input_mt_pos pos[MAX_POINT];
+    int slots[MAX_POINT];
+    int index[MAX_POINT];
+    int contact_cnt = 0;
+    int i;
+
+    if (ptouch_dev == NULL)
+        return;
+
+    for (i=0; i<point_cnt; i++) {
+        if (ptouch_data[i].state == TOUCH_STATE_MV) {
+            pos[contact_cnt].x = ptouch_data[i].X;
+            pos[contact_cnt].y = ptouch_data[i].Y;
+            index[contact_cnt] = i;
+            contact_cnt++;
+        }
+    }
+
+    /* match against the previous frame, new ids for contacts beyond dmax */
+    if (input_mt_assign_slots(ptouch_dev, slots, pos, contact_cnt, TRACKING_MAX_DIST) < 0)
+        return;
 
+    report_frame_time(pDev);
+
+    for (i=0; i<contact_cnt; i++) {
+        const PTR_IRTOUCH_TOUCH_DATA_S pdata = &ptouch_data[index[i]];
+
+        input_mt_slot(ptouch_dev, slots[i]);
+        input_mt_report_slot_state(ptouch_dev, pDev->tool[index[i]], true);
+        input_report_abs(ptouch_dev, ABS_MT_POSITION_X, pdata->X);
+        input_report_abs(ptouch_dev, ABS_MT_POSITION_Y, pdata->Y);
+    #if TOUCH_WIDTH_ENABLE == 1
+        input_report_abs(ptouch_dev, ABS_MT_TOUCH_MAJOR, max(pdata->width, pdata->height)/2);
+        input_report_abs(ptouch_dev, ABS_MT_TOUCH_MINOR, min(pdata->width, pdata->height)/2);
+    #endif
+    }
+
+    /* releases unused slots and reports BTN_TOUCH */
+    input_mt_sync_frame(ptouch_dev);
+    input_sync(ptouch_dev);
+    pDev->contact_cnt = contact_cnt;
+}
+#else
 static void report_touch_event(PTR_IRTOUCH_INPUT_S pDev, const PTR_IRTOUCH_TOUCH_DATA_S ptouch_data, int point_cnt) 
 {
 	struct input_dev *ptouch_dev = pDev->ptouch_dev;
@@ -61,8 +190,9 @@ static void report_touch_event(PTR_IRTOUCH_INPUT_S pDev, const PTR_IRTOUCH_TOUCH
     int position[MAX_POINT]={0}; 
 		
     if (ptouch_dev != NULL) {
+        report_frame_time(pDev);
         for (i=0; i<point_cnt; i++){
-            if (ptouch_data[i].state == TOUCH_STATE_MV){
+            if (ptouch_data[i].state == TOUCH_STATE_MV && ptouch_data[i].id < MAX_POINT){
                fingerflag[ptouch_data[i].id] = FINGER_STATE_DN; 
                position[ptouch_data[i].id] = i;
             }
@@ -70,7 +200,7 @@ static void report_touch_event(PTR_IRTOUCH_INPUT_S pDev, const PTR_IRTOUCH_TOUCH
         for (i=0; i<point_cnt; i++){
             input_mt_slot(ptouch_dev, i);
             if (fingerflag[i]==FINGER_STATE_DN) {
-                input_mt_report_slot_state(ptouch_dev, MT_TOOL_FINGER, true);  
+                input_mt_report_slot_state(ptouch_dev, pDev->tool[position[i]], true);  
                 input_report_abs(ptouch_dev, ABS_MT_POSITION_X, ptouch_data[position[i]].X);   
                 input_report_abs(ptouch_dev, ABS_MT_POSITION_Y, ptouch_data[position[i]].Y);    
             #if TOUCH_WIDTH_ENABLE == 1
@@ -95,53 +225,435 @@ static void report_touch_event(PTR_IRTOUCH_INPUT_S pDev, const PTR_IRTOUCH_TOUCH
             input_report_key(ptouch_dev, BTN_TOUCH, 1);	
         }
         input_sync(ptouch_dev);
+        pDev->contact_cnt = point_cnt - upfingercnt;
     }
 }
+#endif
 
-int irtouch_data_into_input(char *buffer, int count) {
-	PTR_IRTOUCH_TOUCH_DATA_S point_data;
-	int point_count;
-	
-	if (buffer == NULL)
-		return -1;
-	
-	if (count != PER_TOUCH_DATA_SIZE)
-		return -3;
+#if TOUCH_BPF_ENABLE == 1
+/*
+ * Attach point for fmod_ret programs, in the style of HID-BPF. A program
+ * reaches the frame through irtouch_bpf_get_data(), may rewrite points,
+ * set tool[] (e.g. MT_TOOL_PALM) and returns non-zero to drop the frame.
+ */
+__weak noinline int irtouch_bpf_frame_event(struct irtouch_bpf_ctx *ctx)
+{
+	return 0;
+}
+ALLOW_ERROR_INJECTION(irtouch_bpf_frame_event, ERRNO);
 
-	mutex_lock(&G_ptr_irtouch_input_dev->io_mutex);
-	point_data = G_ptr_irtouch_input_dev->irtouch_data;
-	point_count = buffer[PER_TOUCH_DATA_SIZE-1];
-	
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+__bpf_kfunc_start_defs();
+#endif
+
+__bpf_kfunc __u8 *irtouch_bpf_get_data(struct irtouch_bpf_ctx *ctx, unsigned int offset, const size_t rdwr_buf_size)
+{
+	if (!ctx || offset > ctx->size || rdwr_buf_size > ctx->size - offset)
+		return NULL;
+
+	return (__u8 *)ctx->frame + offset;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+__bpf_kfunc_end_defs();
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,9,0)
+BTF_KFUNCS_START(irtouch_bpf_kfunc_ids)
+BTF_ID_FLAGS(func, irtouch_bpf_get_data, KF_RET_NULL)
+BTF_KFUNCS_END(irtouch_bpf_kfunc_ids)
+#else
+BTF_SET8_START(irtouch_bpf_kfunc_ids)
+BTF_ID_FLAGS(func, irtouch_bpf_get_data, KF_RET_NULL)
+BTF_SET8_END(irtouch_bpf_kfunc_ids)
+#endif
+
+static const struct btf_kfunc_id_set irtouch_bpf_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set   = &irtouch_bpf_kfunc_ids,
+};
+#endif
+
+/* caller holds io_mutex, returns 0 when the frame was dropped */
+static int filter_touch_frame(PTR_IRTOUCH_INPUT_S pDev, int panel_id, PTR_IRTOUCH_TOUCH_DATA_S point_data, ktime_t time)
+{
+#if TOUCH_BPF_ENABLE == 1
+	struct irtouch_bpf_ctx ctx;
+	int i;
+
+	memcpy(pDev->bpf_frame.point, point_data, sizeof(pDev->bpf_frame.point));
+	memset(pDev->bpf_frame.tool, MT_TOOL_FINGER, sizeof(pDev->bpf_frame.tool));
+	ctx.frame = &pDev->bpf_frame;
+	ctx.size = sizeof(pDev->bpf_frame);
+	ctx.panel = panel_id;
+	ctx.time_ns = ktime_to_ns(time);
+
+	if (irtouch_bpf_frame_event(&ctx))
+		return 0;
+
+	memcpy(point_data, pDev->bpf_frame.point, sizeof(pDev->bpf_frame.point));
+	/* the input core passes ABS_MT_TOOL_TYPE through unclamped */
+	for (i=0; i<MAX_POINT; i++)
+		pDev->tool[i] = pDev->bpf_frame.tool[i] <= MT_TOOL_MAX ?
+		                pDev->bpf_frame.tool[i] : MT_TOOL_FINGER;
+#endif
+	return 1;
+}
+
+int irtouch_input_bpf_init(void)
+{
+#if TOUCH_BPF_ENABLE == 1
+	return register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &irtouch_bpf_kfunc_set);
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Collect one packet of a frame. A frame is a single packet with up to
+ * PER_POINT contacts, or a packet announcing more followed by continuation
+ * packets up to MAX_POINT. Returns 1 once the frame is complete.
+ */
+static int assemble_touch_packet(PTR_IRTOUCH_TOUCH_DATA_S point_data, int *pack_cnt, const char *buffer)
+{
 	if (buffer[PER_TOUCH_DATA_SIZE-1] > PER_POINT) {
-		memset((void *)point_data, 0, sizeof(point_data));
+		memset((void *)point_data, 0, sizeof(IRTOUCH_TOUCH_DATA_S)*MAX_POINT);
 		memcpy((void *)point_data, (const void *)(buffer+1), sizeof(IRTOUCH_TOUCH_DATA_S)*PER_POINT);
-		G_ptr_irtouch_input_dev->irtouch_pack_cnt = 1;
+		*pack_cnt = 1;
 	} else if (buffer[PER_TOUCH_DATA_SIZE-1] == 0){
-		int pack_cnt = G_ptr_irtouch_input_dev->irtouch_pack_cnt;
-		if (pack_cnt < MAX_POINT/PER_POINT) {
-			memcpy((void *)(point_data+pack_cnt), (const void *)(buffer+1), sizeof(IRTOUCH_TOUCH_DATA_S)*PER_POINT);
-		} else if (pack_cnt == MAX_POINT/PER_POINT){
-			memcpy((void *)(point_data+pack_cnt), (const void *)(buffer+1), sizeof(IRTOUCH_TOUCH_DATA_S)*(MAX_POINT%PER_POINT));
-			report_touch_event(G_ptr_irtouch_input_dev, point_data, MAX_POINT);
+		if (*pack_cnt < MAX_POINT/PER_POINT) {
+			memcpy((void *)(point_data+*pack_cnt*PER_POINT), (const void *)(buffer+1), sizeof(IRTOUCH_TOUCH_DATA_S)*PER_POINT);
+		} else if (*pack_cnt == MAX_POINT/PER_POINT){
+			memcpy((void *)(point_data+*pack_cnt*PER_POINT), (const void *)(buffer+1), sizeof(IRTOUCH_TOUCH_DATA_S)*(MAX_POINT%PER_POINT));
+			(*pack_cnt)++;
+			return 1;
 		} else {
-			mutex_unlock(&G_ptr_irtouch_input_dev->io_mutex);
 			return -2;
 		}
-		G_ptr_irtouch_input_dev->irtouch_pack_cnt++;
+		(*pack_cnt)++;
 	} else {
-		memset((void *)point_data, 0, sizeof(point_data));
+		memset((void *)point_data, 0, sizeof(IRTOUCH_TOUCH_DATA_S)*MAX_POINT);
 		memcpy((void *)point_data, (const char *)(buffer+1), sizeof(IRTOUCH_TOUCH_DATA_S)*PER_POINT);
-		report_touch_event(G_ptr_irtouch_input_dev, point_data, MAX_POINT);
+		return 1;
 	}
+	return 0;
+}
+
+/* time is when the packet was scanned, stamped on the frame it opens */
+int irtouch_data_into_input(char *buffer, int count, ktime_t time) {
+	int retval;
+	
+	if (buffer == NULL)
+		return -1;
+	
+	if (count != PER_TOUCH_DATA_SIZE)
+		return -3;
+
+	mutex_lock(&G_irtouch_input_lock);
+	if (G_ptr_irtouch_input_dev == NULL) {
+		mutex_unlock(&G_irtouch_input_lock);
+		return -ENODEV;
+	}
+	mutex_lock(&G_ptr_irtouch_input_dev->io_mutex);
+	/* the scan time of a frame is the one of its first packet */
+	if (buffer[PER_TOUCH_DATA_SIZE-1] != 0)
+		G_ptr_irtouch_input_dev->report_time = time;
+	retval = assemble_touch_packet(G_ptr_irtouch_input_dev->irtouch_data,
+	                               &G_ptr_irtouch_input_dev->irtouch_pack_cnt, buffer);
+	if (retval == 1 &&
+	    filter_touch_frame(G_ptr_irtouch_input_dev, 0, G_ptr_irtouch_input_dev->irtouch_data,
+	                       G_ptr_irtouch_input_dev->report_time))
+		report_touch_event(G_ptr_irtouch_input_dev, G_ptr_irtouch_input_dev->irtouch_data, MAX_POINT);
 	mutex_unlock(&G_ptr_irtouch_input_dev->io_mutex);
+	mutex_unlock(&G_irtouch_input_lock);
 	
+	return retval < 0 ? retval : 0;
+}
+
+#if TOUCH_STITCH_ENABLE == 1
+/* the point lies where panels a and b overlap, false when they only abut */
+static bool stitch_in_overlap(const PTR_IRTOUCH_PANEL_S a, const PTR_IRTOUCH_PANEL_S b,
+                              const struct input_mt_pos *pos)
+{
+    return pos->x >= max(a->x, b->x) && pos->x < min(a->x + a->w, b->x + b->w) &&
+           pos->y >= max(a->y, b->y) && pos->y < min(a->y + a->h, b->y + b->h);
+}
+
+static bool stitch_stale(const PTR_IRTOUCH_PANEL_S panel, ktime_t now)
+{
+    return ktime_ms_delta(now, panel->seen) > STITCH_STALE_MS;
+}
+
+/* caller holds io_mutex, emits the union of every live panel's last frame */
+static void stitch_report(PTR_IRTOUCH_INPUT_S pDev, ktime_t report_time)
+{
+    ktime_t now = ktime_get();
+	struct input_dev *ptouch_dev = pDev->ptouch_dev;
+    struct input_mt_pos pos[MAX_POINT];
+    unsigned short major[MAX_POINT], minor[MAX_POINT];
+    unsigned char tool[MAX_POINT];
+    int origin[MAX_POINT];
+    int slots[MAX_POINT];
+    int contact_cnt = 0;
+    int p, i, j;
+
+    for (p=0; p<STITCH_MAX_PANEL; p++) {
+        PTR_IRTOUCH_PANEL_S panel = &pDev->panel[p];
+
+        /* a panel that went silent doesn't keep its contacts down */
+        if (!panel->used || stitch_stale(panel, now))
+            continue;
+        for (i=0; i<panel->contact_cnt; i++) {
+            /* overlapping panels see the same touch, keep one */
+            for (j=0; j<contact_cnt; j++) {
+                PTR_IRTOUCH_PANEL_S other = &pDev->panel[origin[j]];
+
+                if (origin[j] != p &&
+                    abs(pos[j].x - panel->pos[i].x) < STITCH_MERGE_DIST &&
+                    abs(pos[j].y - panel->pos[i].y) < STITCH_MERGE_DIST &&
+                    stitch_in_overlap(panel, other, &pos[j]) &&
+                    stitch_in_overlap(panel, other, &panel->pos[i]))
+                    break;
+            }
+            if (j < contact_cnt) {
+                pos[j].x = (pos[j].x + panel->pos[i].x) / 2;
+                pos[j].y = (pos[j].y + panel->pos[i].y) / 2;
+                major[j] = max(major[j], panel->major[i]);
+                minor[j] = max(minor[j], panel->minor[i]);
+                if (panel->tool[i] != MT_TOOL_FINGER)
+                    tool[j] = panel->tool[i];
+            } else if (contact_cnt < MAX_POINT) {
+                pos[contact_cnt] = panel->pos[i];
+                major[contact_cnt] = panel->major[i];
+                minor[contact_cnt] = panel->minor[i];
+                tool[contact_cnt] = panel->tool[i];
+                origin[contact_cnt] = p;
+                contact_cnt++;
+            }
+        }
+        panel->fresh = false;
+    }
+
+    /* tracking in global space keeps ids stable across seams */
+    if (input_mt_assign_slots(ptouch_dev, slots, pos, contact_cnt, TRACKING_MAX_DIST) < 0)
+        return;
+
+    pDev->report_time = report_time;
+    report_frame_time(pDev);
+    for (i=0; i<contact_cnt; i++) {
+        input_mt_slot(ptouch_dev, slots[i]);
+        input_mt_report_slot_state(ptouch_dev, tool[i], true);
+        input_report_abs(ptouch_dev, ABS_MT_POSITION_X, pos[i].x);
+        input_report_abs(ptouch_dev, ABS_MT_POSITION_Y, pos[i].y);
+    #if TOUCH_WIDTH_ENABLE == 1
+        input_report_abs(ptouch_dev, ABS_MT_TOUCH_MAJOR, major[i]);
+        input_report_abs(ptouch_dev, ABS_MT_TOUCH_MINOR, minor[i]);
+    #endif
+    }
+    input_mt_sync_frame(ptouch_dev);
+    input_sync(ptouch_dev);
+    pDev->contact_cnt = contact_cnt;
+}
+
+/* caller holds io_mutex, maps the assembled frame into global space */
+static void stitch_store(PTR_IRTOUCH_INPUT_S pDev, PTR_IRTOUCH_PANEL_S panel)
+{
+    int i;
+
+    panel->seen = ktime_get();
+    panel->contact_cnt = 0;
+    for (i=0; i<MAX_POINT; i++) {
+        const PTR_IRTOUCH_TOUCH_DATA_S pdata = &panel->data[i];
+        int n = panel->contact_cnt;
+
+        if (pdata->state != TOUCH_STATE_MV)
+            continue;
+        panel->pos[n].x = panel->x + pdata->X * panel->w / STITCH_FULL_SCALE;
+        panel->pos[n].y = panel->y + pdata->Y * panel->h / STITCH_FULL_SCALE;
+        panel->tool[n] = pDev->tool[i];
+    #if TOUCH_WIDTH_ENABLE == 1
+        panel->major[n] = max(pdata->width * panel->w, pdata->height * panel->h) / STITCH_FULL_SCALE / 2;
+        panel->minor[n] = min(pdata->width * panel->w, pdata->height * panel->h) / STITCH_FULL_SCALE / 2;
+    #endif
+        panel->contact_cnt++;
+    }
+}
+
+int irtouch_stitch_data_into_input(int panel_id, char *buffer, int count, ktime_t time)
+{
+	PTR_IRTOUCH_INPUT_S pDev;
+	PTR_IRTOUCH_PANEL_S panel;
+	int retval;
+	int p;
+
+	if (buffer == NULL)
+		return -1;
+
+	if (count != PER_TOUCH_DATA_SIZE)
+		return -3;
+
+	if (panel_id < 0 || panel_id >= STITCH_MAX_PANEL)
+		return -EINVAL;
+
+	mutex_lock(&G_irtouch_input_lock);
+	pDev = G_ptr_irtouch_input_dev;
+	if (pDev == NULL || !pDev->panel[panel_id].used) {
+		mutex_unlock(&G_irtouch_input_lock);
+		return -ENODEV;
+	}
+	mutex_lock(&pDev->io_mutex);
+	panel = &pDev->panel[panel_id];
+	if (buffer[PER_TOUCH_DATA_SIZE-1] != 0)
+		panel->report_time = time;
+	retval = assemble_touch_packet(panel->data, &panel->pack_cnt, buffer);
+	if (retval == 1 && filter_touch_frame(pDev, panel_id, panel->data, panel->report_time)) {
+		/* a panel running ahead doesn't wait for the others */
+		bool ahead = panel->fresh;
+
+		stitch_store(pDev, panel);
+		panel->fresh = true;
+		/* one combined frame once every live panel has delivered its own */
+		for (p=0; p<STITCH_MAX_PANEL; p++) {
+			if (pDev->panel[p].used && !pDev->panel[p].fresh &&
+			    !stitch_stale(&pDev->panel[p], panel->seen))
+				break;
+		}
+		if (ahead || p == STITCH_MAX_PANEL)
+			stitch_report(pDev, panel->report_time);
+	}
+	mutex_unlock(&pDev->io_mutex);
+	mutex_unlock(&G_irtouch_input_lock);
+
+	return retval < 0 ? retval : 0;
+}
+
+int irtouch_input_attach_panel(void)
+{
+	PTR_IRTOUCH_INPUT_S pDev = G_ptr_irtouch_input_dev;
+	int p;
+
+	mutex_lock(&pDev->io_mutex);
+	for (p=0; p<STITCH_MAX_PANEL; p++) {
+		if (!pDev->panel[p].used) {
+			memset(&pDev->panel[p], 0, sizeof(IRTOUCH_PANEL_S));
+			pDev->panel[p].used = true;
+			pDev->panel[p].w = STITCH_FULL_SCALE;
+			pDev->panel[p].h = STITCH_FULL_SCALE;
+			break;
+		}
+	}
+	mutex_unlock(&pDev->io_mutex);
+
+	return p < STITCH_MAX_PANEL ? p : -ENOSPC;
+}
+
+void irtouch_input_detach_panel(int panel_id)
+{
+	PTR_IRTOUCH_INPUT_S pDev = G_ptr_irtouch_input_dev;
+
+	if (panel_id < 0 || panel_id >= STITCH_MAX_PANEL)
+		return;
+
+	mutex_lock(&pDev->io_mutex);
+	pDev->panel[panel_id].used = false;
+	/* lift the contacts the panel still had down */
+	stitch_report(pDev, ktime_get());
+	mutex_unlock(&pDev->io_mutex);
+}
+
+int irtouch_input_set_panel_geometry(int panel_id, int x, int y, int w, int h)
+{
+	PTR_IRTOUCH_INPUT_S pDev = G_ptr_irtouch_input_dev;
+
+	if (panel_id < 0 || panel_id >= STITCH_MAX_PANEL)
+		return -EINVAL;
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+	    x + w > STITCH_FULL_SCALE || y + h > STITCH_FULL_SCALE)
+		return -EINVAL;
+
+	mutex_lock(&pDev->io_mutex);
+	pDev->panel[panel_id].x = x;
+	pDev->panel[panel_id].y = y;
+	pDev->panel[panel_id].w = w;
+	pDev->panel[panel_id].h = h;
+	mutex_unlock(&pDev->io_mutex);
+
 	return 0;
 }
 
+void irtouch_input_get_panel_geometry(int panel_id, int *x, int *y, int *w, int *h)
+{
+	PTR_IRTOUCH_INPUT_S pDev = G_ptr_irtouch_input_dev;
+
+	*x = *y = *w = *h = 0;
+	if (panel_id < 0 || panel_id >= STITCH_MAX_PANEL)
+		return;
+
+	mutex_lock(&pDev->io_mutex);
+	*x = pDev->panel[panel_id].x;
+	*y = pDev->panel[panel_id].y;
+	*w = pDev->panel[panel_id].w;
+	*h = pDev->panel[panel_id].h;
+	mutex_unlock(&pDev->io_mutex);
+}
+#endif
+
+int irtouch_input_contact_count(void)
+{
+    int contact_cnt = 0;
+
+	mutex_lock(&G_irtouch_input_lock);
+    if (G_ptr_irtouch_input_dev)
+        contact_cnt = G_ptr_irtouch_input_dev->contact_cnt;
+	mutex_unlock(&G_irtouch_input_lock);
+
+    return contact_cnt;
+}
+
+/* lift every contact, used when the touch stream stops */
+void irtouch_input_release_all(void)
+{
+	PTR_IRTOUCH_INPUT_S pDev;
+    int i;
+
+	mutex_lock(&G_irtouch_input_lock);
+	pDev = G_ptr_irtouch_input_dev;
+    if (pDev == NULL || pDev->ptouch_dev == NULL) {
+        mutex_unlock(&G_irtouch_input_lock);
+        return;
+    }
+
+	mutex_lock(&pDev->io_mutex);
+    for (i=0; i<MAX_POINT; i++) {
+        input_mt_slot(pDev->ptouch_dev, i);
+        input_mt_report_slot_state(pDev->ptouch_dev, MT_TOOL_FINGER, false);
+    }
+    input_report_key(pDev->ptouch_dev, BTN_TOUCH, 0);
+    input_sync(pDev->ptouch_dev);
+    pDev->irtouch_pack_cnt = 0;
+    pDev->contact_cnt = 0;
+#if TOUCH_STITCH_ENABLE == 1
+    for (i=0; i<STITCH_MAX_PANEL; i++) {
+        pDev->panel[i].pack_cnt = 0;
+        pDev->panel[i].contact_cnt = 0;
+        pDev->panel[i].fresh = false;
+    }
+#endif
+	mutex_unlock(&pDev->io_mutex);
+	mutex_unlock(&G_irtouch_input_lock);
+}
+
 int irtouch_input_init(void)
 {
 	int retval=0;
 	PTR_IRTOUCH_INPUT_S pDev;
+
+	/* every probed board shares the one input device */
+	mutex_lock(&G_irtouch_input_lock);
+	if (G_irtouch_input_users++) {
+		mutex_unlock(&G_irtouch_input_lock);
+		return 0;
+	}
 	
 	G_ptr_irtouch_input_dev = kzalloc(sizeof(IRTOUCH_INPUT_S), GFP_KERNEL);
 	if (!G_ptr_irtouch_input_dev) {
@@ -165,30 +677,53 @@ int irtouch_input_init(void)
 
     pDev->ptouch_dev->evbit[0] = BIT_MASK(EV_SYN) | BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS);
     pDev->ptouch_dev->keybit[BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH);
+    input_set_capability(pDev->ptouch_dev, EV_MSC, MSC_TIMESTAMP);
 
+#if TOUCH_TRACKING_ENABLE == 1 || TOUCH_STITCH_ENABLE == 1
+    input_mt_init_slots(pDev->ptouch_dev, MAX_POINT,
+                        INPUT_MT_DIRECT | INPUT_MT_DROP_UNUSED | INPUT_MT_TRACK);
+#else
     input_mt_init_slots(pDev->ptouch_dev, MAX_POINT, INPUT_MT_DIRECT);
+#endif
 	input_set_abs_params(pDev->ptouch_dev, ABS_MT_POSITION_X, 0, 32767, 0, 0);
 	input_set_abs_params(pDev->ptouch_dev, ABS_MT_POSITION_Y, 0, 32767, 0, 0);
     #if TOUCH_WIDTH_ENABLE == 1
 	input_set_abs_params(pDev->ptouch_dev, ABS_MT_TOUCH_MAJOR, 0, 32767, 0, 0);
 	input_set_abs_params(pDev->ptouch_dev, ABS_MT_TOUCH_MINOR, 0, 32767, 0, 0);
 	#endif
+#if TOUCH_BPF_ENABLE == 1
+	input_set_abs_params(pDev->ptouch_dev, ABS_MT_TOOL_TYPE, 0, MT_TOOL_MAX, 0, 0);
+#endif
     if (input_register_device(pDev->ptouch_dev) < 0) {
 		DBG_PRINTK("Failed to register IRtouch-algo device\n");
 		input_free_device(pDev->ptouch_dev);
+		retval = -1;
 		goto error;
     }
 
+	mutex_unlock(&G_irtouch_input_lock);
     return 0; 
 error:
+	kfree(G_ptr_irtouch_input_dev);
+	G_ptr_irtouch_input_dev = NULL;
+	G_irtouch_input_users--;
+	mutex_unlock(&G_irtouch_input_lock);
 	return retval;     
 }
 
 void irtouch_input_exit(void)
 {
 	PTR_IRTOUCH_INPUT_S pDev = G_ptr_irtouch_input_dev;
+
+	mutex_lock(&G_irtouch_input_lock);
+	if (--G_irtouch_input_users) {
+		mutex_unlock(&G_irtouch_input_lock);
+		return;
+	}
 	
 	input_unregister_device(pDev->ptouch_dev);
 	kfree(G_ptr_irtouch_input_dev);
+	G_ptr_irtouch_input_dev = NULL;
+	mutex_unlock(&G_irtouch_input_lock);
 }
 
@@ -10,9 +10,41 @@
 #include <linux/input.h>
 #include <linux/platform_device.h>
 #include <linux/version.h>
+#include <linux/input/mt.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <asm/unaligned.h>
 
 #define SYS_INPUT_MAX_BUF_SIZE 1024
 
+/*
+ * Replay recorded touch sessions on a multitouch device shaped like
+ * IRtouch-algo. The trace is written to /dev/virtual_touch_trace, then
+ * "start [N]" to the virtual_touch_replay attribute plays it at the recorded
+ * timing, or N times faster. Reading the attribute reports progress,
+ * achieved frame rate and timing error. At most one frame is played per
+ * timer expiry; frames that can't keep up are played late and counted.
+ *
+ * trace:   "VTTR" le32 version, then frames until the end of the trace
+ * frame:   le64 timestamp_ns, u8 contact count, u8 reserved[3], contacts
+ * contact: u8 slot, u8 reserved, le16 x, y, major, minor
+ * Slots not listed in a frame are released.
+ */
+#define VIRTUAL_TOUCH_ENABLE 0
+#define VIRTUAL_TOUCH_MAX_POINT 20
+#define VIRTUAL_TOUCH_TRACE_MAGIC 0x52545456    /* "VTTR" */
+#define VIRTUAL_TOUCH_TRACE_VERSION 1
+#define VIRTUAL_TOUCH_TRACE_HDR_SIZE 8
+#define VIRTUAL_TOUCH_FRAME_HDR_SIZE 12
+#define VIRTUAL_TOUCH_CONTACT_SIZE 10
+#define VIRTUAL_TOUCH_TRACE_MAX (64 << 20)
+#define VIRTUAL_TOUCH_MAX_SCALE 100
+#define VIRTUAL_TOUCH_MIN_GAP_NS (100 * NSEC_PER_USEC)   /* between two frames */
+
 static struct input_dev *g_dev_keyboard;
 
 static ssize_t get_virtual_board(struct device_driver *_drv, char *_buf)
@@ -46,6 +78,328 @@ static ssize_t set_virtual_board(struct device_driver *_drv, const char *_buf, s
 
 static DRIVER_ATTR(virtual_board, 0666, get_virtual_board, set_virtual_board);
 
+#if VIRTUAL_TOUCH_ENABLE == 1
+static struct input_dev *g_dev_touch;
+
+static struct {
+    struct mutex lock;          /* trace buffer and replay start/stop */
+    struct hrtimer timer;
+    unsigned char *trace;
+    size_t trace_len;
+    size_t trace_cap;
+    size_t cursor;              /* next frame */
+    bool running;
+    unsigned int scale;
+    unsigned int frames_total;
+    unsigned int frames_played;
+    unsigned int frames_late;   /* played at least MIN_GAP after they were due */
+    u64 trace_start_ns;         /* timestamp of the first frame */
+    ktime_t start;              /* when the first frame was due */
+    ktime_t last;               /* when the last frame was played */
+    u64 err_sum_ns;
+    u64 err_max_ns;
+} g_replay;
+
+static u64 virtual_touch_frame_ts(size_t offset)
+{
+    return get_unaligned_le64(g_replay.trace + offset);
+}
+
+static size_t virtual_touch_frame_len(size_t offset)
+{
+    return VIRTUAL_TOUCH_FRAME_HDR_SIZE +
+           g_replay.trace[offset + 8] * VIRTUAL_TOUCH_CONTACT_SIZE;
+}
+
+/* walk the whole trace once so the timer never sees a malformed frame */
+static int virtual_touch_trace_check(void)
+{
+    size_t offset = VIRTUAL_TOUCH_TRACE_HDR_SIZE;
+    u64 prev_ts = 0;
+    unsigned int frames = 0;
+    unsigned int i, count;
+
+    if (g_replay.trace_len < VIRTUAL_TOUCH_TRACE_HDR_SIZE ||
+        get_unaligned_le32(g_replay.trace) != VIRTUAL_TOUCH_TRACE_MAGIC ||
+        get_unaligned_le32(g_replay.trace + 4) != VIRTUAL_TOUCH_TRACE_VERSION)
+        return -EINVAL;
+
+    while (offset < g_replay.trace_len) {
+        if (g_replay.trace_len - offset < VIRTUAL_TOUCH_FRAME_HDR_SIZE)
+            return -EINVAL;
+        count = g_replay.trace[offset + 8];
+        if (count > VIRTUAL_TOUCH_MAX_POINT ||
+            g_replay.trace_len - offset < virtual_touch_frame_len(offset))
+            return -EINVAL;
+        if (frames && virtual_touch_frame_ts(offset) < prev_ts)
+            return -EINVAL;
+        for (i = 0; i < count; i++) {
+            if (g_replay.trace[offset + VIRTUAL_TOUCH_FRAME_HDR_SIZE +
+                               i * VIRTUAL_TOUCH_CONTACT_SIZE] >= VIRTUAL_TOUCH_MAX_POINT)
+                return -EINVAL;
+        }
+        prev_ts = virtual_touch_frame_ts(offset);
+        offset += virtual_touch_frame_len(offset);
+        frames++;
+    }
+
+    if (!frames)
+        return -EINVAL;
+    g_replay.frames_total = frames;
+    return 0;
+}
+
+static void virtual_touch_report_frame(size_t offset)
+{
+    const unsigned char *contact = g_replay.trace + offset + VIRTUAL_TOUCH_FRAME_HDR_SIZE;
+    unsigned int i, count = g_replay.trace[offset + 8];
+
+    for (i = 0; i < count; i++, contact += VIRTUAL_TOUCH_CONTACT_SIZE) {
+        input_mt_slot(g_dev_touch, contact[0]);
+        input_mt_report_slot_state(g_dev_touch, MT_TOOL_FINGER, true);
+        input_report_abs(g_dev_touch, ABS_MT_POSITION_X, get_unaligned_le16(contact + 2));
+        input_report_abs(g_dev_touch, ABS_MT_POSITION_Y, get_unaligned_le16(contact + 4));
+        input_report_abs(g_dev_touch, ABS_MT_TOUCH_MAJOR, get_unaligned_le16(contact + 6));
+        input_report_abs(g_dev_touch, ABS_MT_TOUCH_MINOR, get_unaligned_le16(contact + 8));
+    }
+    /* releases the slots this frame didn't mention */
+    input_mt_sync_frame(g_dev_touch);
+    input_sync(g_dev_touch);
+}
+
+static void virtual_touch_release_all(void)
+{
+    input_mt_sync_frame(g_dev_touch);
+    input_sync(g_dev_touch);
+}
+
+static ktime_t virtual_touch_due(size_t offset)
+{
+    u64 delta = virtual_touch_frame_ts(offset) - g_replay.trace_start_ns;
+
+    return ktime_add_ns(g_replay.start, div_u64(delta, g_replay.scale));
+}
+
+static enum hrtimer_restart virtual_touch_replay_timer(struct hrtimer *timer)
+{
+    ktime_t now = ktime_get();
+    ktime_t due = virtual_touch_due(g_replay.cursor);
+    ktime_t next;
+    s64 err = ktime_to_ns(ktime_sub(now, due));
+
+    virtual_touch_report_frame(g_replay.cursor);
+    g_replay.last = now;
+    g_replay.frames_played++;
+    if (err >= VIRTUAL_TOUCH_MIN_GAP_NS)
+        g_replay.frames_late++;
+    if (err < 0)
+        err = -err;
+    g_replay.err_sum_ns += err;
+    if (err > g_replay.err_max_ns)
+        g_replay.err_max_ns = err;
+
+    g_replay.cursor += virtual_touch_frame_len(g_replay.cursor);
+    if (g_replay.cursor >= g_replay.trace_len) {
+        virtual_touch_release_all();
+        WRITE_ONCE(g_replay.running, false);
+        return HRTIMER_NORESTART;
+    }
+
+    /* never re-arm into the past, catching up would run in hard-IRQ */
+    next = ktime_add_ns(ktime_get(), VIRTUAL_TOUCH_MIN_GAP_NS);
+    due = virtual_touch_due(g_replay.cursor);
+    hrtimer_set_expires(timer, ktime_after(due, next) ? due : next);
+    return HRTIMER_RESTART;
+}
+
+/* caller holds g_replay.lock */
+static void virtual_touch_replay_stop(void)
+{
+    if (hrtimer_cancel(&g_replay.timer))
+        virtual_touch_release_all();
+    g_replay.running = false;
+}
+
+/* caller holds g_replay.lock */
+static int virtual_touch_replay_start(unsigned int scale)
+{
+    int ret;
+
+    virtual_touch_replay_stop();
+    ret = virtual_touch_trace_check();
+    if (ret)
+        return ret;
+
+    g_replay.scale = scale;
+    g_replay.cursor = VIRTUAL_TOUCH_TRACE_HDR_SIZE;
+    g_replay.frames_played = 0;
+    g_replay.frames_late = 0;
+    g_replay.err_sum_ns = 0;
+    g_replay.err_max_ns = 0;
+    g_replay.trace_start_ns = virtual_touch_frame_ts(g_replay.cursor);
+    g_replay.start = ktime_get();
+    g_replay.last = g_replay.start;
+    g_replay.running = true;
+    hrtimer_start(&g_replay.timer, g_replay.start, HRTIMER_MODE_ABS);
+    return 0;
+}
+
+static ssize_t get_virtual_touch_replay(struct device_driver *_drv, char *_buf)
+{
+    u64 span_ns, rate_mhz = 0, err_avg_ns = 0;
+    unsigned int played, late;
+    u32 rate_frac;
+
+    mutex_lock(&g_replay.lock);
+    played = g_replay.frames_played;
+    late = g_replay.frames_late;
+    span_ns = ktime_to_ns(ktime_sub(g_replay.last, g_replay.start));
+    /* the first frame opens the measured span */
+    if (played > 1 && span_ns)
+        rate_mhz = div64_u64((u64)(played - 1) * NSEC_PER_SEC * 1000, span_ns);
+    if (played)
+        err_avg_ns = div_u64(g_replay.err_sum_ns, played);
+    mutex_unlock(&g_replay.lock);
+
+    return snprintf(_buf, SYS_INPUT_MAX_BUF_SIZE,
+                    "state: %s\nframes: %u/%u\nlate: %u\nscale: %u\nrate_hz: %llu.%03llu\n"
+                    "err_avg_us: %llu\nerr_max_us: %llu\n",
+                    READ_ONCE(g_replay.running) ? "running" : "idle",
+                    played, g_replay.frames_total, late, g_replay.scale,
+                    div_u64_rem(rate_mhz, 1000, &rate_frac), (u64)rate_frac,
+                    div_u64(err_avg_ns, NSEC_PER_USEC),
+                    div_u64(g_replay.err_max_ns, NSEC_PER_USEC));
+}
+
+static ssize_t set_virtual_touch_replay(struct device_driver *_drv, const char *_buf, size_t _count)
+{
+    unsigned int scale = 1;
+    int ret = 0;
+
+    mutex_lock(&g_replay.lock);
+    if (!strncmp(_buf, "start", 5)) {
+        if (sscanf(_buf + 5, "%u", &scale) != 1)
+            scale = 1;
+        if (scale && scale <= VIRTUAL_TOUCH_MAX_SCALE)
+            ret = virtual_touch_replay_start(scale);
+        else
+            ret = -EINVAL;
+    } else if (!strncmp(_buf, "stop", 4)) {
+        virtual_touch_replay_stop();
+    } else {
+        ret = -EINVAL;
+    }
+    mutex_unlock(&g_replay.lock);
+
+    return ret ? ret : _count;
+}
+
+static DRIVER_ATTR(virtual_touch_replay, 0664, get_virtual_touch_replay, set_virtual_touch_replay);
+
+static int virtual_touch_trace_open(struct inode *inode, struct file *file)
+{
+    int ret = 0;
+
+    if (!(file->f_mode & FMODE_WRITE))
+        return -EINVAL;
+
+    /* every writer uploads a new trace */
+    mutex_lock(&g_replay.lock);
+    if (READ_ONCE(g_replay.running))
+        ret = -EBUSY;
+    else
+        g_replay.trace_len = 0;
+    mutex_unlock(&g_replay.lock);
+    return ret;
+}
+
+static ssize_t virtual_touch_trace_write(struct file *file, const char __user *buf,
+                                         size_t count, loff_t *ppos)
+{
+    unsigned char *trace;
+    size_t cap;
+    ssize_t ret = count;
+
+    mutex_lock(&g_replay.lock);
+    if (READ_ONCE(g_replay.running)) {
+        ret = -EBUSY;
+        goto out;
+    }
+    if (count > VIRTUAL_TOUCH_TRACE_MAX - g_replay.trace_len) {
+        ret = -EFBIG;
+        goto out;
+    }
+    if (g_replay.trace_len + count > g_replay.trace_cap) {
+        cap = max_t(size_t, g_replay.trace_cap * 2, g_replay.trace_len + count);
+        cap = min_t(size_t, cap, VIRTUAL_TOUCH_TRACE_MAX);
+        trace = vmalloc(cap);
+        if (!trace) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        if (g_replay.trace)
+            memcpy(trace, g_replay.trace, g_replay.trace_len);
+        vfree(g_replay.trace);
+        g_replay.trace = trace;
+        g_replay.trace_cap = cap;
+    }
+    if (copy_from_user(g_replay.trace + g_replay.trace_len, buf, count)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    g_replay.trace_len += count;
+    *ppos += count;
+out:
+    mutex_unlock(&g_replay.lock);
+    return ret;
+}
+
+static const struct file_operations virtual_touch_trace_fops = {
+    .owner  = THIS_MODULE,
+    .open   = virtual_touch_trace_open,
+    .write  = virtual_touch_trace_write,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice virtual_touch_trace_dev = {
+    .minor  = MISC_DYNAMIC_MINOR,
+    .name   = "virtual_touch_trace",
+    .fops   = &virtual_touch_trace_fops,
+};
+
+static void alloc_and_register_touch_device(void)
+{
+    struct input_dev *tmp;
+
+    g_dev_touch = 0;
+
+    tmp = input_allocate_device();
+    if (!tmp)
+        return;
+
+    tmp->name = "virtual_touch_board";
+    tmp->phys = "virtual_touch_board/input0";
+    tmp->id.bustype = BUS_HOST;
+    tmp->id.vendor = 0x0088;
+    tmp->id.product = 0x0004;
+    tmp->id.version = 0x0100;
+
+    /* same axes and slots as IRtouch-algo */
+    input_set_capability(tmp, EV_KEY, BTN_TOUCH);
+    input_set_abs_params(tmp, ABS_MT_POSITION_X, 0, 32767, 0, 0);
+    input_set_abs_params(tmp, ABS_MT_POSITION_Y, 0, 32767, 0, 0);
+    input_set_abs_params(tmp, ABS_MT_TOUCH_MAJOR, 0, 32767, 0, 0);
+    input_set_abs_params(tmp, ABS_MT_TOUCH_MINOR, 0, 32767, 0, 0);
+    if (input_mt_init_slots(tmp, VIRTUAL_TOUCH_MAX_POINT,
+                            INPUT_MT_DIRECT | INPUT_MT_DROP_UNUSED) ||
+        input_register_device(tmp)) {
+        input_free_device(tmp);
+        return;
+    }
+    g_dev_touch = tmp;
+}
+#endif
+
 void alloc_and_register_device(void)
 {
     int error;
@@ -98,6 +452,22 @@ static int __init virtual_board_init(void)
     alloc_and_register_device();
 
     ret = driver_create_file(&(virtual_board_platform_driver.driver), &driver_attr_virtual_board);
+
+#if VIRTUAL_TOUCH_ENABLE == 1
+    mutex_init(&g_replay.lock);
+    hrtimer_init(&g_replay.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    g_replay.timer.function = virtual_touch_replay_timer;
+    g_replay.scale = 1;
+
+    alloc_and_register_touch_device();
+    if (g_dev_touch && misc_register(&virtual_touch_trace_dev)) {
+        input_unregister_device(g_dev_touch);
+        g_dev_touch = 0;
+    }
+    if (g_dev_touch)
+        ret = driver_create_file(&(virtual_board_platform_driver.driver),
+                                 &driver_attr_virtual_touch_replay);
+#endif
     return 0;
 }
 
@@ -105,6 +475,17 @@ static void __exit virtual_board_exit(void)
 {
     driver_remove_file(&(virtual_board_platform_driver.driver), &driver_attr_virtual_board);
 
+#if VIRTUAL_TOUCH_ENABLE == 1
+    if (g_dev_touch) {
+        driver_remove_file(&(virtual_board_platform_driver.driver),
+                           &driver_attr_virtual_touch_replay);
+        misc_deregister(&virtual_touch_trace_dev);
+        hrtimer_cancel(&g_replay.timer);
+        input_unregister_device(g_dev_touch);
+    }
+    vfree(g_replay.trace);
+#endif
+
     if(g_dev_keyboard)
     {
         input_unregister_device(g_dev_keyboard);
@@ -15,11 +15,31 @@
 #include <linux/completion.h>
 #include <linux/spinlock.h>
 #include <linux/sysfs.h>
+#include <linux/delay.h>
+#include <linux/semaphore.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
 #include <linux/input.h>
 #include <linux/input/mt.h>
+#include <linux/version.h>
+#include <linux/compat.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
+
+#include "irtouch__ioctl.h"
 
 #define DRIVER_VERSION	   "V1.0.2-20170614"
 
+/* struct usb_driver lost its drvwrap in 6.8 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
+  #define IRTOUCH_DRV(_udrv)	(&(_udrv)->driver)
+#else
+  #define IRTOUCH_DRV(_udrv)	(&(_udrv)->drvwrap.driver)
+#endif
+
 #define USB_IRTOUCH_VENDOR_ID		  0x1FF7
 #define USB_IRTOUCH_PRODUCT_ID		  0x0013
 
@@ -32,6 +52,20 @@
 #define BULK_TIMEOUT_READ	(HZ/20)  //50ms
 #define BULK_TIMEOUT_WRITE       (HZ/20)
 
+#define CMD_PUMP_TIMEOUT		(HZ/100) //10ms, bulk-in slice of a command waiter
+
+#define SCAN_IDLE_TIMEOUT_MS	60000	 //no contact for this long drops to idle rate
+#define SCAN_RATE_ACTIVE		120		 //scans per second
+#define SCAN_RATE_IDLE			10
+/* frame gaps must stay well below HEALTH_STALL_TIMEOUT */
+#define SCAN_RATE_MIN			10
+#define SCAN_IDLE_PERIOD		HZ		 //state check while idle
+
+#define HEALTH_CHECK_PERIOD		(HZ/2)	 //500ms
+#define HEALTH_STALL_TIMEOUT	(2*HZ)	 //no bulk-in data while being polled
+#define HEALTH_RESET_HOLDOFF	(5*HZ)	 //give a reset device time to come back
+#define HEALTH_ERR_BURST		8		 //consecutive errors before recovery
+
 #define DEBUG 0
 #if DEBUG==1
   #define DBG_PRINTK(args...) printk("irtouch-algo.c[DBG]: "args)
@@ -43,6 +77,46 @@
 
 #define USE_IRTOUCH_INPUT_DEVICE 0
 #define USE_IRTOUCH_ALGO_DRIVER 0
+
+/*
+ * Bind the HID touch interface too, so the same touches are not decoded by
+ * usbhid and by the algo path. IRTOUCH_TOUCH_PATH picks the one that
+ * reports: with TOUCH_PATH_ALGO the touch interface is claimed and never
+ * polled, with TOUCH_PATH_HID it is left to usbhid and the algo path does
+ * not start its touch reporting. A claimed interface is only unbound on
+ * disconnect, usbhid doesn't get it back before a replug.
+ */
+#define USE_IRTOUCH_CLAIM_TOUCH_INF 0
+#define TOUCH_PATH_ALGO 0
+#define TOUCH_PATH_HID  1
+#define IRTOUCH_TOUCH_PATH TOUCH_PATH_ALGO
+
+/*
+ * Several boards tiled over one display report through one input device,
+ * each placed by its stitch/geometry attribute. Must match
+ * TOUCH_STITCH_ENABLE in irtouch__input.c. The in-kernel algo module is a
+ * singleton serving the first board only, so separate panels are fed
+ * through the per-device IRTOUCH_IOC_XFER TOUCH_SEND path.
+ */
+#define USE_IRTOUCH_STITCH 0
+
+#if USE_IRTOUCH_CLAIM_TOUCH_INF == 1 && IRTOUCH_TOUCH_PATH == TOUCH_PATH_ALGO \
+	&& (USE_IRTOUCH_ALGO_DRIVER == 0 || USE_IRTOUCH_INPUT_DEVICE == 0)
+  #error "TOUCH_PATH_ALGO takes the touch interface from usbhid but nothing would report touch"
+#endif
+
+#if USE_IRTOUCH_CLAIM_TOUCH_INF == 1 && IRTOUCH_TOUCH_PATH == TOUCH_PATH_HID
+  #define USE_IRTOUCH_ALGO_TOUCH 0
+#else
+  #define USE_IRTOUCH_ALGO_TOUCH 1
+#endif
+
+/* the scan governor only runs where the algo path reports the contacts it sees */
+#if USE_IRTOUCH_ALGO_DRIVER == 1 && USE_IRTOUCH_INPUT_DEVICE == 1 && USE_IRTOUCH_ALGO_TOUCH == 1
+  #define USE_IRTOUCH_SCAN_GOVERNOR 1
+#else
+  #define USE_IRTOUCH_SCAN_GOVERNOR 0
+#endif
 /*----------------------------------------------*
  * constants									*
  *----------------------------------------------*/
@@ -53,6 +127,73 @@ enum endpoint_in
 	ENP_IN_NUM2,
 };
 
+/* recovery steps of the health watchdog, in escalation order */
+enum recover_level
+{
+	RECOVER_NONE,
+	RECOVER_CLEAR_HALT,
+	RECOVER_RESTART_URB,
+	RECOVER_RESET_DEVICE,
+};
+
+/*
+ * Tagged command channel. A command packet carries a tag byte at
+ * IRTOUCH_CMD_TAG_OFFSET which the firmware echoes in its response, the
+ * response is recognised by IRTOUCH_CMD_REPORT_ID in byte 0. Responses are
+ * routed to the waiting caller by tag wherever the bulk-in data is read, so
+ * several commands can be in flight while the touch stream keeps running.
+ * IRTOUCH_IOC_CMD in irtouch__ioctl.h is the userspace side.
+ */
+#define IRTOUCH_CMD_REPORT_ID		0xFC
+#define IRTOUCH_CMD_TAG_OFFSET		1
+#define IRTOUCH_CMD_TAG_INTERNAL	0		/* driver's own commands, never handed out */
+#define IRTOUCH_CMD_MAX_INFLIGHT	8
+#define IRTOUCH_FRAME_FIFO_SIZE		1024	/* frames read by command waiters */
+#define IRTOUCH_FRAME_FIFO_DEPTH	16
+
+/*
+ * Offset of a le32 firmware scan counter in the bulk-in packet, -1 if the
+ * firmware sends none and the urb completion time stamps the frame.
+ */
+#define IRTOUCH_SCAN_COUNTER_OFFSET	-1
+#define IRTOUCH_SCAN_COUNTER_NS		1000	/* counter tick */
+#define IRTOUCH_SCAN_RESYNC_NS		(100 * NSEC_PER_MSEC)
+
+/*
+ * Firmware update. IRTOUCH_IOC_FW_UPDATE takes the whole image and streams
+ * it to the panel bootloader in blocks, keeping IRTOUCH_FW_WINDOW OUT urbs
+ * in flight. Every block is acknowledged by the panel, with
+ * IRTOUCH_FW_VERIFY the image is read back before it is committed. Touch
+ * is paused for the duration, progress is in the firmware/ sysfs group.
+ *
+ * block:    [IRTOUCH_CMD_REPORT_ID][tag][op][0][offset le32][payload]
+ * response: [IRTOUCH_CMD_REPORT_ID][tag][op][status][offset le32][data]
+ */
+#define IRTOUCH_FW_OP_BEGIN			0x01	/* offset = image size */
+#define IRTOUCH_FW_OP_DATA			0x02
+#define IRTOUCH_FW_OP_READ			0x03	/* payload[0] = length */
+#define IRTOUCH_FW_OP_END			0x04
+#define IRTOUCH_CMD_SET_SCAN_RATE	0x10	/* [id][tag][op][rate le16] */
+#define IRTOUCH_FW_HDR_SIZE			8
+#define IRTOUCH_FW_WINDOW			8
+#define IRTOUCH_FW_ACK_TIMEOUT		(HZ/2)
+#define IRTOUCH_FW_BEGIN_TIMEOUT	(10*HZ)	 //may include a flash erase
+
+enum scan_state
+{
+	SCAN_STATE_ACTIVE,
+	SCAN_STATE_IDLE,
+};
+
+enum fw_state
+{
+	FW_STATE_IDLE,
+	FW_STATE_WRITING,
+	FW_STATE_VERIFYING,
+	FW_STATE_DONE,
+	FW_STATE_FAILED,
+};
+
 /* table of devices that work with this driver */
 static const struct usb_device_id irtouch_table[] = 
 {
@@ -72,11 +213,39 @@ static const struct usb_device_id irtouch_table[] =
 		.idProduct      = USB_IRTOUCH_A8_PRODUCT_ID,
         .bInterfaceNumber = USB_INF_NUM_ALGO,
 	},
+#if USE_IRTOUCH_CLAIM_TOUCH_INF == 1 && IRTOUCH_TOUCH_PATH == TOUCH_PATH_ALGO
+	{
+		.match_flags	= USB_DEVICE_ID_MATCH_VENDOR | \
+						  USB_DEVICE_ID_MATCH_PRODUCT | \
+						  USB_DEVICE_ID_MATCH_INT_NUMBER,
+		.idVendor		= USB_IRTOUCH_VENDOR_ID,
+		.idProduct		= USB_IRTOUCH_PRODUCT_ID,
+		.bInterfaceNumber = USB_INF_NUM_TOUCH,
+	},
+	{
+		.match_flags	= USB_DEVICE_ID_MATCH_VENDOR | \
+						  USB_DEVICE_ID_MATCH_PRODUCT | \
+						  USB_DEVICE_ID_MATCH_INT_NUMBER,
+		.idVendor		= USB_IRTOUCH_A8_VENDOR_ID,
+		.idProduct		= USB_IRTOUCH_A8_PRODUCT_ID,
+		.bInterfaceNumber = USB_INF_NUM_TOUCH,
+	},
+#endif
 
 	{},
 };
 MODULE_DEVICE_TABLE(usb, irtouch_table);
 
+typedef struct _IRTOUCH_CMD_SLOT_S
+{
+	bool					in_use;
+	u8						tag;
+	unsigned char			*resp;				/* caller's response buffer */
+	int						resp_size;
+	int						resp_len;
+	struct completion		complete;
+} IRTOUCH_CMD_SLOT_S, *PTR_IRTOUCH_CMD_SLOT_S;
+
 typedef struct _IRTOUCH_DEV_S 
 {
 	struct usb_device		*udev;				/* the usb device for this device */
@@ -96,13 +265,87 @@ typedef struct _IRTOUCH_DEV_S
 	struct completion		complete_read;		/* read complete */
 	struct completion		complete_write;		/* write complete */
 	
+	int						bulk_in_status;		/* status of last read urb */
+	ktime_t					bulk_in_time;		/* completion of last read urb */
+	ktime_t					frame_time;			/* scan time of last touch frame */
+	ktime_t					scan_anchor_time;	/* scan counter to ktime mapping */
+	u32						scan_anchor_cnt;
+	bool					scan_anchored;
+	int						bulk_out_status;	/* status of last write urb */
+
 	struct kref				refcount;
-	struct mutex		io_mutex_bulk;
+	struct mutex		io_mutex_bulk;			/* serializes bulk-in */
+	struct mutex		io_mutex_out;			/* serializes bulk-out, nests inside io_mutex_bulk */
+
+	/* tagged command channel, slots are protected by cmd_lock */
+	spinlock_t				cmd_lock;
+	struct semaphore		cmd_sem;			/* free command slots */
+	u8						cmd_next_tag;
+	IRTOUCH_CMD_SLOT_S		cmd_slot[IRTOUCH_CMD_MAX_INFLIGHT];
+	/* frames read by command waiters, protected by io_mutex_bulk */
+	STRUCT_KFIFO_REC_1(IRTOUCH_FRAME_FIFO_SIZE) frame_fifo;
+	DECLARE_KFIFO(frame_time_fifo, ktime_t, IRTOUCH_FRAME_FIFO_DEPTH);
+	unsigned int			cnt_frame_drop;
+
+	/* firmware update, touch and commands are refused while fw_active */
+	atomic_t				fw_active;
+	int						fw_state;
+	int						fw_error;
+	unsigned int			fw_total;			/* bytes to write or verify */
+	unsigned int			fw_done;			/* bytes acked or verified */
+	unsigned int			fw_written;			/* bytes acked in the write phase */
+	unsigned long			fw_start_jiffies;
+	unsigned long			fw_end_jiffies;
+	struct usb_anchor		fw_anchor;
+	struct urb				*fw_urb[IRTOUCH_FW_WINDOW];
+	unsigned char			*fw_buf[IRTOUCH_FW_WINDOW];
+	unsigned long			fw_urb_busy;		/* bitmap of submitted fw urbs */
+	int						fw_urb_status;		/* first fw urb error */
+	wait_queue_head_t		fw_wait;
+
+	/* scan-rate governor, fields below are protected by scan_lock */
+	struct delayed_work		scan_work;
+	spinlock_t				scan_lock;
+	bool					scan_stop;
+	int						scan_state;
+	unsigned long			scan_touch_jiffies;	/* last frame with a contact */
+	unsigned long			scan_state_jiffies;	/* entered scan_state */
+	u64						scan_time_ms[2];	/* per scan_state, excluding current */
+	unsigned int			scan_switch_count;
+	unsigned int			scan_idle_ms;		/* 0 disables the governor */
+	unsigned int			scan_rate_active;
+	unsigned int			scan_rate_idle;
+	unsigned int			scan_rate_sent;		/* rate last set on the panel, 0 unknown */
+
+	/* health watchdog, fields below are protected by health_lock */
+	struct delayed_work		health_work;
+	spinlock_t				health_lock;
+	bool					health_stop;		/* disconnect in progress */
+	bool					halt_in;			/* bulk-in endpoint stalled */
+	bool					halt_out;			/* bulk-out endpoint stalled */
+	int						recover_level;		/* last recovery step taken */
+	unsigned int			err_burst;			/* consecutive errors */
+	bool					polling;			/* bulk-in polled, no data since */
+	unsigned long			poll_start_jiffies;	/* first unanswered bulk-in request */
+	unsigned long			last_poll_jiffies;	/* last bulk-in request */
+	unsigned long			fault_jiffies;		/* start of fault, 0 if healthy */
+	unsigned long			holdoff_jiffies;	/* no recovery before this */
+	unsigned int			cnt_error;
+	unsigned int			cnt_clear_halt;
+	unsigned int			cnt_restart_urb;
+	unsigned int			cnt_reset_device;
+	unsigned int			cnt_recovered;
+	unsigned int			last_recover_ms;
+	unsigned int			max_recover_ms;
+
+	struct usb_interface	*touch_inf;			/* claimed HID touch interface */
+	int						panel;				/* stitch panel index */
 } IRTOUCH_DEV_S, *PTR_IRTOUCH_DEV_S;
 
 /*----------------------------------------------*
  * internal routine prototypes					*
  *----------------------------------------------*/
+static void irtouch_delete(struct kref *kref);
 
 /*----------------------------------------------*
  * project-wide global variables				*
@@ -118,8 +361,18 @@ extern uint32_t ExitIRTouchModule(void);
 extern uint8_t * GetIRTouchModuleInfo(void);
 #endif
 #if USE_IRTOUCH_INPUT_DEVICE == 1
+extern int irtouch_input_contact_count(void);
 extern int irtouch_input_init(void);
 extern void irtouch_input_exit(void);
+extern void irtouch_input_release_all(void);
+extern int irtouch_input_bpf_init(void);
+#if USE_IRTOUCH_STITCH == 1
+extern int irtouch_stitch_data_into_input(int panel_id, char *buffer, int count, ktime_t time);
+extern int irtouch_input_attach_panel(void);
+extern void irtouch_input_detach_panel(int panel_id);
+extern int irtouch_input_set_panel_geometry(int panel_id, int x, int y, int w, int h);
+extern void irtouch_input_get_panel_geometry(int panel_id, int *x, int *y, int *w, int *h);
+#endif
 #endif
 
 /*----------------------------------------------*
@@ -127,6 +380,276 @@ extern void irtouch_input_exit(void);
  *----------------------------------------------*/
 static struct usb_driver irtouch_driver;
 
+#if USE_IRTOUCH_ALGO_DRIVER == 1 && USE_IRTOUCH_ALGO_TOUCH == 1
+/* InitIRTouchModule() takes one device, the first board probed owns it */
+static DEFINE_MUTEX(G_algo_lock);
+static PTR_IRTOUCH_DEV_S G_algo_owner;
+#endif
+
+//============================== health watchdog START =========================
+static void irtouch_health_good(PTR_IRTOUCH_DEV_S pDev)
+{
+	unsigned long flags;
+	unsigned int ms;
+
+	spin_lock_irqsave(&pDev->health_lock, flags);
+	pDev->polling = false;
+	pDev->err_burst = 0;
+	if (pDev->fault_jiffies) {
+		ms = jiffies_to_msecs(jiffies - pDev->fault_jiffies);
+		pDev->last_recover_ms = ms;
+		if (ms > pDev->max_recover_ms)
+			pDev->max_recover_ms = ms;
+		pDev->cnt_recovered++;
+		pDev->fault_jiffies = 0;
+		pDev->recover_level = RECOVER_NONE;
+		spin_unlock_irqrestore(&pDev->health_lock, flags);
+		dev_info(&pDev->udev->dev, "irtouch recovered after %u ms\n", ms);
+		return;
+	}
+	spin_unlock_irqrestore(&pDev->health_lock, flags);
+}
+
+static void irtouch_health_error(PTR_IRTOUCH_DEV_S pDev, int status, bool is_in)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pDev->health_lock, flags);
+	pDev->cnt_error++;
+	/* silence on bulk-in is left to the stall timer in irtouch_health_check() */
+	if (is_in && status == -ETIMEDOUT) {
+		spin_unlock_irqrestore(&pDev->health_lock, flags);
+		return;
+	}
+	pDev->err_burst++;
+	if (!pDev->fault_jiffies)
+		pDev->fault_jiffies = jiffies;
+	if (status == -EPIPE) {
+		if (is_in)
+			pDev->halt_in = true;
+		else
+			pDev->halt_out = true;
+	}
+	/* don't wait for the next period when the fault is obvious */
+	if (!pDev->health_stop
+		&& (pDev->halt_in || pDev->halt_out || pDev->err_burst >= HEALTH_ERR_BURST)
+		&& time_after_eq(jiffies, pDev->holdoff_jiffies))
+		mod_delayed_work(system_wq, &pDev->health_work, 0);
+	spin_unlock_irqrestore(&pDev->health_lock, flags);
+}
+
+static void irtouch_health_poll(PTR_IRTOUCH_DEV_S pDev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pDev->health_lock, flags);
+	/* a quiet period without any reader doesn't count towards a stall */
+	if (!pDev->polling
+		|| time_after(jiffies, pDev->last_poll_jiffies + HEALTH_STALL_TIMEOUT)) {
+		pDev->polling = true;
+		pDev->poll_start_jiffies = jiffies;
+	}
+	pDev->last_poll_jiffies = jiffies;
+	spin_unlock_irqrestore(&pDev->health_lock, flags);
+}
+
+static void irtouch_recover_clear_halt(PTR_IRTOUCH_DEV_S pDev, bool halt_in, bool halt_out)
+{
+	int retval;
+
+	mutex_lock(&pDev->io_mutex_bulk);
+	mutex_lock(&pDev->io_mutex_out);
+	if (pDev->interface) {
+		usb_kill_urb(pDev->bulk_in_urb);
+		usb_kill_urb(pDev->bulk_out_urb);
+		/* clear both when the fault wasn't an explicit stall */
+		if (halt_in || !halt_out) {
+			retval = usb_clear_halt(pDev->udev,
+					usb_rcvbulkpipe(pDev->udev, pDev->u8InputEPAddr));
+			if (retval)
+				dev_err(&pDev->interface->dev, "clear halt bulk-in error %d\n", retval);
+		}
+		if (halt_out || !halt_in) {
+			retval = usb_clear_halt(pDev->udev,
+					usb_sndbulkpipe(pDev->udev, pDev->u8OutputEPAddr));
+			if (retval)
+				dev_err(&pDev->interface->dev, "clear halt bulk-out error %d\n", retval);
+		}
+	}
+	mutex_unlock(&pDev->io_mutex_out);
+	mutex_unlock(&pDev->io_mutex_bulk);
+}
+
+static void irtouch_recover_restart_urb(PTR_IRTOUCH_DEV_S pDev)
+{
+	struct usb_host_interface *pInfDesc;
+	int retval;
+
+	mutex_lock(&pDev->io_mutex_bulk);
+	mutex_lock(&pDev->io_mutex_out);
+	if (pDev->interface) {
+		usb_kill_urb(pDev->bulk_in_urb);
+		usb_kill_urb(pDev->bulk_out_urb);
+		kfifo_reset(&pDev->frame_fifo);
+		kfifo_reset(&pDev->frame_time_fifo);
+		reinit_completion(&pDev->complete_read);
+		reinit_completion(&pDev->complete_write);
+		pDev->bulk_in_filled = 0;
+		pDev->bulk_out_filled = 0;
+		/* re-selecting the altsetting resets the endpoints on both sides */
+		pInfDesc = pDev->interface->cur_altsetting;
+		retval = usb_set_interface(pDev->udev, pInfDesc->desc.bInterfaceNumber,
+					pInfDesc->desc.bAlternateSetting);
+		if (retval)
+			dev_err(&pDev->interface->dev, "restart interface error %d\n", retval);
+	}
+	mutex_unlock(&pDev->io_mutex_out);
+	mutex_unlock(&pDev->io_mutex_bulk);
+}
+
+static void irtouch_health_check(struct work_struct *work)
+{
+	PTR_IRTOUCH_DEV_S pDev = container_of(to_delayed_work(work), IRTOUCH_DEV_S, health_work);
+	unsigned long next = HEALTH_CHECK_PERIOD;
+	bool halt_in, halt_out, faulty;
+	int level;
+
+	spin_lock_irq(&pDev->health_lock);
+	/* the bootloader doesn't stream, and a reset would brick the panel */
+	if (atomic_read(&pDev->fw_active))
+		goto requeue;
+	if (time_before(jiffies, pDev->holdoff_jiffies)) {
+		next = pDev->holdoff_jiffies - jiffies;
+		goto requeue;
+	}
+
+	halt_in  = pDev->halt_in;
+	halt_out = pDev->halt_out;
+	/* being polled for data but nothing arrives is a stalled stream */
+	faulty = halt_in || halt_out
+		|| pDev->err_burst >= HEALTH_ERR_BURST
+		|| (pDev->polling && time_after(pDev->last_poll_jiffies,
+				pDev->poll_start_jiffies + HEALTH_STALL_TIMEOUT));
+	if (!faulty)
+		goto requeue;
+
+	if (!pDev->fault_jiffies)
+		pDev->fault_jiffies = jiffies;
+	if (pDev->recover_level < RECOVER_RESET_DEVICE)
+		pDev->recover_level++;
+	level = pDev->recover_level;
+	pDev->halt_in = false;
+	pDev->halt_out = false;
+	pDev->err_burst = 0;
+	/* restart stall detection from now on */
+	pDev->polling = false;
+	switch (level) {
+		case RECOVER_CLEAR_HALT:
+			pDev->cnt_clear_halt++;
+			break;
+		case RECOVER_RESTART_URB:
+			pDev->cnt_restart_urb++;
+			break;
+		default:
+			pDev->cnt_reset_device++;
+			next = HEALTH_RESET_HOLDOFF;
+			break;
+	}
+	pDev->holdoff_jiffies = jiffies + next;
+	spin_unlock_irq(&pDev->health_lock);
+
+	dev_warn(&pDev->udev->dev, "irtouch stalled, recovery level %d\n", level);
+	switch (level) {
+		case RECOVER_CLEAR_HALT:
+			irtouch_recover_clear_halt(pDev, halt_in, halt_out);
+			break;
+		case RECOVER_RESTART_URB:
+			irtouch_recover_restart_urb(pDev);
+			break;
+		default:
+			usb_queue_reset_device(pDev->interface);
+			break;
+	}
+
+	spin_lock_irq(&pDev->health_lock);
+requeue:
+	if (!pDev->health_stop)
+		mod_delayed_work(system_wq, &pDev->health_work, next);
+	spin_unlock_irq(&pDev->health_lock);
+}
+
+static void irtouch_health_start(PTR_IRTOUCH_DEV_S pDev)
+{
+	spin_lock_irq(&pDev->health_lock);
+	pDev->health_stop = false;
+	pDev->polling = false;
+	pDev->last_poll_jiffies = jiffies;
+	mod_delayed_work(system_wq, &pDev->health_work, HEALTH_CHECK_PERIOD);
+	spin_unlock_irq(&pDev->health_lock);
+}
+
+static void irtouch_health_stop(PTR_IRTOUCH_DEV_S pDev)
+{
+	spin_lock_irq(&pDev->health_lock);
+	pDev->health_stop = true;
+	spin_unlock_irq(&pDev->health_lock);
+	cancel_delayed_work_sync(&pDev->health_work);
+}
+
+#define IRTOUCH_COUNTER_ATTR(_name, _field)									\
+static ssize_t get_##_name(struct device *dev,								\
+				struct device_attribute *attr, char *buf)				\
+{																			\
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));		\
+																			\
+	if (!pDev)																\
+		return -ENODEV;														\
+	return sprintf(buf, "%u\n", pDev->_field);								\
+}																			\
+static DEVICE_ATTR(_name, 0444, get_##_name, NULL)
+
+IRTOUCH_COUNTER_ATTR(error_count, cnt_error);
+IRTOUCH_COUNTER_ATTR(clear_halt_count, cnt_clear_halt);
+IRTOUCH_COUNTER_ATTR(restart_count, cnt_restart_urb);
+IRTOUCH_COUNTER_ATTR(reset_count, cnt_reset_device);
+IRTOUCH_COUNTER_ATTR(recovered_count, cnt_recovered);
+IRTOUCH_COUNTER_ATTR(last_recover_ms, last_recover_ms);
+IRTOUCH_COUNTER_ATTR(max_recover_ms, max_recover_ms);
+
+static ssize_t get_state(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+	static const char * const level_name[] = {
+		"stalled", "clear-halt", "restart", "reset",
+	};
+
+	if (!pDev)
+		return -ENODEV;
+	if (!pDev->fault_jiffies)
+		return sprintf(buf, "ok\n");
+	return sprintf(buf, "%s %u\n", level_name[pDev->recover_level],
+			jiffies_to_msecs(jiffies - pDev->fault_jiffies));
+}
+static DEVICE_ATTR(state, 0444, get_state, NULL);
+
+static struct attribute *irtouch_health_attrs[] = {
+	&dev_attr_state.attr,
+	&dev_attr_error_count.attr,
+	&dev_attr_clear_halt_count.attr,
+	&dev_attr_restart_count.attr,
+	&dev_attr_reset_count.attr,
+	&dev_attr_recovered_count.attr,
+	&dev_attr_last_recover_ms.attr,
+	&dev_attr_max_recover_ms.attr,
+	NULL,
+};
+
+static const struct attribute_group irtouch_health_group = {
+	.name	= "health",
+	.attrs	= irtouch_health_attrs,
+};
+//============================== health watchdog END ===========================
+
 //==============================================================================
 static void irtouch_notifier_write_int_callback(struct urb *urb)
 {
@@ -142,9 +665,13 @@ static void irtouch_notifier_write_int_callback(struct urb *urb)
 			dev_err(&pDev->interface->dev,
 				"%s - error: %d\n",
 				__func__, urb->status);
+			irtouch_health_error(pDev, urb->status, false);
+			pDev->bulk_out_status = urb->status;
+			complete(&pDev->complete_write);
 		}
 		pDev->bulk_out_filled = 0;
 	} else {
+		pDev->bulk_out_status = 0;
 		pDev->bulk_out_filled = urb->actual_length;
 		complete(&pDev->complete_write);
 	}
@@ -165,11 +692,17 @@ static void irtouch_read_urb_callback(struct urb *urb)
 			dev_err(&pDev->interface->dev,
 				"%s - error: %d\n",
 				__func__, urb->status);
+			irtouch_health_error(pDev, urb->status, true);
+			pDev->bulk_in_status = urb->status;
+			complete(&pDev->complete_read);
 		}
 		pDev->bulk_in_filled = 0;
 	}
 	else
 	{
+		pDev->bulk_in_time = ktime_get();
+		irtouch_health_good(pDev);
+		pDev->bulk_in_status = 0;
 		pDev->bulk_in_filled = urb->actual_length;
 		complete(&pDev->complete_read);
 	}
@@ -195,6 +728,8 @@ static int irtouch_read_data(PTR_IRTOUCH_DEV_S	pDev, unsigned int size)
 			pDev);
 			
 	pDev->bulk_in_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	/* drop a completion left behind by a urb that finished after its timeout */
+	reinit_completion(&pDev->complete_read);
 	/* do it */
 	retval = usb_submit_urb(pDev->bulk_in_urb, GFP_KERNEL);
 
@@ -226,6 +761,7 @@ static int irtouch_write_data(PTR_IRTOUCH_DEV_S	 pDev, unsigned int size)
 				irtouch_notifier_write_int_callback,\
 				pDev);
 
+	reinit_completion(&pDev->complete_write);
 	retval = usb_submit_urb(pDev->bulk_out_urb, GFP_KERNEL);
 	
 	if (retval)
@@ -262,6 +798,8 @@ static int irtouch_open(struct inode *inode, struct file *file)
 			goto exit;
 	}
 			
+	/* keep pDev alive until release, even across disconnect */
+	kref_get(&pDev->refcount);
 	file->private_data = pDev;
 	return 0;
 	
@@ -271,6 +809,10 @@ exit:
 
 static int irtouch_release(struct inode *inode, struct file *file)
 {
+	PTR_IRTOUCH_DEV_S pDev = file->private_data;
+
+	if (pDev)
+		kref_put(&pDev->refcount, irtouch_delete);
 	DBG_PRINTK("%s OK", __func__);
 	return 0;
 }
@@ -279,131 +821,1247 @@ static int irtouch_release(struct inode *inode, struct file *file)
 #define DRIVER_IOCTL_TYPE_BULK_WRITE 	   1 
 #define DRIVER_IOCTL_TYPE_TOUCH_SEND 	   2
 #define DRIVER_IOCTL_TYPE_GET_SSID   	   3
-extern int irtouch_data_into_input(char *buffer ,int count);
-static int irtouch_ioctl_driver(void *pDEV, unsigned char *buffer, int length, unsigned char type)
+extern int irtouch_data_into_input(char *buffer ,int count, ktime_t time);
+/* caller holds io_mutex_out, the data to send is in pOutputBuf */
+static int irtouch_bulk_write_locked(PTR_IRTOUCH_DEV_S pDev, int length, long timeout)
 {
-	PTR_IRTOUCH_DEV_S pDev = (PTR_IRTOUCH_DEV_S)pDEV;
-	int retval = 0;
+	long left;
+	int retval;
 
-	if (pDev == NULL) {
-		return -ENODEV;
-	}
-	
-	if (buffer == NULL) {
-		ERR_PRINTK("irtouch_ioctl_data buffer null\n");
-		return -ENOMEM;	 
+	retval = irtouch_write_data(pDev, length);
+	if (retval) {
+		if (retval != -ENODEV)
+			irtouch_health_error(pDev, retval, false);
+		return retval;
 	}
 
-	switch(type) {
-		case DRIVER_IOCTL_TYPE_BULK_WRITE:
-			if (pDev->bulk_out_size < length)
-				return -EINVAL;
-			mutex_lock(&pDev->io_mutex_bulk);	
-			memcpy(pDev->pOutputBuf, buffer, length);
-			irtouch_write_data(pDev, length);
-			if (wait_for_completion_killable_timeout(&pDev->complete_write, BULK_TIMEOUT_WRITE)) {
-				retval = pDev->bulk_out_filled;
-			} else {
-				DBG_PRINTK("bulk writed time out\n");
-                                usb_kill_urb(pDev->bulk_out_urb);
-				retval = -ETIMEDOUT;
-			}
-			mutex_unlock(&pDev->io_mutex_bulk);
-			break;
-		case DRIVER_IOCTL_TYPE_BULK_READ:
-			if (pDev->bulk_in_size < length)
-                                return -EINVAL;
-			mutex_lock(&pDev->io_mutex_bulk);	
-			irtouch_read_data(pDev, length);
-			if (wait_for_completion_killable_timeout(&pDev->complete_read, BULK_TIMEOUT_READ)) {
-				retval = pDev->bulk_in_filled;
-				memcpy(buffer, pDev->pInputBuf, pDev->bulk_in_filled);
-			} else {
-				DBG_PRINTK("bulk read time out\n");
-				usb_kill_urb(pDev->bulk_in_urb);
-				retval = -ETIMEDOUT;
-			}
-			mutex_unlock(&pDev->io_mutex_bulk);	
-			break;
-		case DRIVER_IOCTL_TYPE_TOUCH_SEND:
-#if USE_IRTOUCH_INPUT_DEVICE == 1
-			retval = irtouch_data_into_input(buffer, length);
-#endif
-			break;
-		default:
-			return -ENOTTY;
-	}
+	left = wait_for_completion_killable_timeout(&pDev->complete_write, timeout);
+	if (left > 0)
+		return pDev->bulk_out_status ? pDev->bulk_out_status : pDev->bulk_out_filled;
 
-	return retval;
+	usb_kill_urb(pDev->bulk_out_urb);
+	if (left < 0)
+		return left;
+	DBG_PRINTK("bulk writed time out\n");
+	irtouch_health_error(pDev, -ETIMEDOUT, false);
+	return -ETIMEDOUT;
 }
 
-static const struct file_operations irtouch_fops = {
-	.owner =	THIS_MODULE,
-	.open =		irtouch_open,
-	.release =	irtouch_release,
-};
-
 /*
- * usb class driver info in order to get a minor number from the usb core,
- * and to have the device registered with the driver core
+ * caller holds io_mutex_bulk, the received data is left in pInputBuf.
+ * An unwatched read (a command waiter's short slice) doesn't count as a
+ * poll nor its timeout as a fault.
  */
-static struct usb_class_driver irtouch_class = {
-	.name =		"irtouch-bulk%d",
-	.fops =		&irtouch_fops,
-	.minor_base =	180,
-};
+static int irtouch_bulk_read_once(PTR_IRTOUCH_DEV_S pDev, int length, long timeout, bool watched)
+{
+	long left;
+	int retval;
 
-static void irtouch_delete(struct kref *kref)
+	if (watched)
+		irtouch_health_poll(pDev);
+	retval = irtouch_read_data(pDev, length);
+	if (retval) {
+		if (retval != -ENODEV)
+			irtouch_health_error(pDev, retval, true);
+		return retval;
+	}
+
+	left = wait_for_completion_killable_timeout(&pDev->complete_read, timeout);
+	if (left > 0)
+		return pDev->bulk_in_status ? pDev->bulk_in_status : pDev->bulk_in_filled;
+
+	usb_kill_urb(pDev->bulk_in_urb);
+	if (left < 0)
+		return left;
+	DBG_PRINTK("bulk read time out\n");
+	if (watched)
+		irtouch_health_error(pDev, -ETIMEDOUT, true);
+	return -ETIMEDOUT;
+}
+
+/*
+ * Hand a tagged response to the command waiting for it. Returns true when
+ * the packet was consumed, anything else is touch data.
+ */
+static bool irtouch_cmd_dispatch(PTR_IRTOUCH_DEV_S pDev, const unsigned char *data, int length)
 {
-	PTR_IRTOUCH_DEV_S  pDev	 = (PTR_IRTOUCH_DEV_S)container_of(kref, IRTOUCH_DEV_S, refcount);
-	
-	DBG_PRINTK("%s Line:%d", __func__, __LINE__);
-	
-	if (pDev->bulk_in_urb)
-	{
-		usb_kill_urb(pDev->bulk_in_urb);
-		usb_free_urb(pDev->bulk_in_urb);
+	PTR_IRTOUCH_CMD_SLOT_S pSlot;
+	bool routed = false;
+	unsigned long flags;
+	int i;
+
+	if (length <= IRTOUCH_CMD_TAG_OFFSET || data[0] != IRTOUCH_CMD_REPORT_ID)
+		return false;
+	/* echoes of the driver's own commands, e.g. a scan rate change */
+	if (data[IRTOUCH_CMD_TAG_OFFSET] == IRTOUCH_CMD_TAG_INTERNAL)
+		return true;
+
+	spin_lock_irqsave(&pDev->cmd_lock, flags);
+	for (i = 0; i < IRTOUCH_CMD_MAX_INFLIGHT; i++) {
+		pSlot = &pDev->cmd_slot[i];
+		if (!pSlot->in_use || pSlot->tag != data[IRTOUCH_CMD_TAG_OFFSET]
+			|| completion_done(&pSlot->complete))
+			continue;
+		pSlot->resp_len = min(length, pSlot->resp_size);
+		memcpy(pSlot->resp, data, pSlot->resp_len);
+		complete(&pSlot->complete);
+		routed = true;
+		break;
 	}
-	
-	if (pDev->bulk_out_urb)
-	{
-		usb_kill_urb(pDev->bulk_out_urb);
-		usb_free_urb(pDev->bulk_out_urb);
+	spin_unlock_irqrestore(&pDev->cmd_lock, flags);
+
+	return routed;
+}
+
+/*
+ * When the frame was scanned. With a firmware scan counter the counter is
+ * mapped onto ktime through an anchor packet; a packet that would have been
+ * scanned after it arrived, or a mapping that drifted too far behind,
+ * re-anchors, so the anchor settles on the lowest-latency packet seen.
+ */
+static ktime_t irtouch_scan_time(PTR_IRTOUCH_DEV_S pDev, const unsigned char *data, int length)
+{
+#if IRTOUCH_SCAN_COUNTER_OFFSET >= 0
+	ktime_t arrival = pDev->bulk_in_time;
+	ktime_t scan;
+	u32 counter;
+
+	if (length < IRTOUCH_SCAN_COUNTER_OFFSET + 4)
+		return arrival;
+
+	counter = get_unaligned_le32(data + IRTOUCH_SCAN_COUNTER_OFFSET);
+	if (pDev->scan_anchored) {
+		scan = ktime_add_ns(pDev->scan_anchor_time,
+				(u64)(counter - pDev->scan_anchor_cnt) * IRTOUCH_SCAN_COUNTER_NS);
+		if (ktime_compare(scan, arrival) <= 0
+			&& ktime_to_ns(ktime_sub(arrival, scan)) < IRTOUCH_SCAN_RESYNC_NS)
+			return scan;
 	}
-	
-	if (pDev->udev)
-	{
-		usb_put_dev(pDev->udev);
+	pDev->scan_anchor_cnt = counter;
+	pDev->scan_anchor_time = arrival;
+	pDev->scan_anchored = true;
+	return arrival;
+#else
+	return pDev->bulk_in_time;
+#endif
+}
+
+/* caller holds io_mutex_bulk, the received frame is left in pInputBuf */
+static int irtouch_bulk_read_locked(PTR_IRTOUCH_DEV_S pDev, int length, long timeout)
+{
+	unsigned long deadline = jiffies + timeout;
+	int retval;
+
+	/* frames picked up by command waiters while we didn't own bulk-in */
+	if (!kfifo_is_empty(&pDev->frame_fifo)) {
+		if (!kfifo_get(&pDev->frame_time_fifo, &pDev->frame_time))
+			pDev->frame_time = ktime_get();
+		return kfifo_out(&pDev->frame_fifo, pDev->pInputBuf, length);
 	}
-		
-	if (pDev->pInputBuf)
-	{
-		usb_free_coherent(pDev->udev, pDev->bulk_in_size,
-                          pDev->pInputBuf, pDev->bulk_in_urb->transfer_dma);
+
+	for (;;) {
+		retval = irtouch_bulk_read_once(pDev, length, timeout, true);
+		if (retval <= 0)
+			return retval;
+		if (!irtouch_cmd_dispatch(pDev, pDev->pInputBuf, retval)) {
+			pDev->frame_time = irtouch_scan_time(pDev, pDev->pInputBuf, retval);
+			return retval;
+		}
+		/* a command response went to its caller, keep waiting for a frame */
+		if (time_after_eq(jiffies, deadline))
+			return -ETIMEDOUT;
+		timeout = deadline - jiffies;
 	}
-	
-	if (pDev->pOutputBuf)
-	{
-		kfree(pDev->pOutputBuf);
+}
+
+/* read one slice of bulk-in on behalf of command waiters, returns < 0 on error */
+static int irtouch_cmd_pump(PTR_IRTOUCH_DEV_S pDev, long timeout)
+{
+	int retval;
+
+	if (!pDev->interface)
+		return -ENODEV;
+	retval = irtouch_bulk_read_once(pDev, pDev->bulk_in_size, timeout, false);
+	if (retval <= 0 || irtouch_cmd_dispatch(pDev, pDev->pInputBuf, retval))
+		return retval;
+	/* keep the frame for the touch reader */
+	if (kfifo_avail(&pDev->frame_fifo) < retval + 1 || kfifo_is_full(&pDev->frame_time_fifo)) {
+		pDev->cnt_frame_drop++;
+	} else {
+		kfifo_in(&pDev->frame_fifo, pDev->pInputBuf, retval);
+		kfifo_put(&pDev->frame_time_fifo, irtouch_scan_time(pDev, pDev->pInputBuf, retval));
 	}
-	
-	kfree(pDev);
-	DBG_PRINTK("%s Line:%d", __func__, __LINE__);
+	return retval;
 }
 
-//==============================================================================
-static int irtouch_probe(struct usb_interface *interface,
-							const struct usb_device_id *id)
+/* caller holds cmd_lock */
+static bool irtouch_cmd_tag_busy(PTR_IRTOUCH_DEV_S pDev, u8 tag)
 {
-	PTR_IRTOUCH_DEV_S				   pDev		   = NULL;
-	struct usb_host_interface			*pInfDesc	= NULL;
-	struct usb_endpoint_descriptor		*pEndPoint	= NULL;
-	int retval										= -ENOMEM;
 	int i;
-	
-	DBG_PRINTK("%s Start!", __func__);
-	
-	/* allocate memory for our device state and initialize it */
+
+	for (i = 0; i < IRTOUCH_CMD_MAX_INFLIGHT; i++) {
+		if (pDev->cmd_slot[i].in_use && pDev->cmd_slot[i].tag == tag)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Send one tagged command and wait for its response. Only bulk-out is held
+ * while sending, the response is picked up by whoever reads bulk-in, so
+ * neither the touch stream nor other commands wait for this one.
+ */
+static int irtouch_command(PTR_IRTOUCH_DEV_S pDev, const unsigned char *cmd, int cmd_len,
+			unsigned char *resp, int resp_size, long timeout, u8 *tag)
+{
+	PTR_IRTOUCH_CMD_SLOT_S pSlot = NULL;
+	unsigned long deadline;
+	long slice;
+	int retval;
+	int pumped;
+	int i;
+
+	if (cmd_len <= IRTOUCH_CMD_TAG_OFFSET || cmd_len > pDev->bulk_out_size)
+		return -EINVAL;
+
+	if (down_interruptible(&pDev->cmd_sem))
+		return -ERESTARTSYS;
+
+	spin_lock_irq(&pDev->cmd_lock);
+	for (i = 0; i < IRTOUCH_CMD_MAX_INFLIGHT; i++) {
+		if (!pDev->cmd_slot[i].in_use) {
+			pSlot = &pDev->cmd_slot[i];
+			break;
+		}
+	}
+	/* tags of in-flight commands are never reused */
+	do {
+		pDev->cmd_next_tag++;
+	} while (pDev->cmd_next_tag == IRTOUCH_CMD_TAG_INTERNAL
+		|| irtouch_cmd_tag_busy(pDev, pDev->cmd_next_tag));
+	pSlot->in_use = true;
+	pSlot->tag = pDev->cmd_next_tag;
+	pSlot->resp = resp;
+	pSlot->resp_size = resp_size;
+	pSlot->resp_len = 0;
+	reinit_completion(&pSlot->complete);
+	spin_unlock_irq(&pDev->cmd_lock);
+	*tag = pSlot->tag;
+
+	mutex_lock(&pDev->io_mutex_out);
+	memcpy(pDev->pOutputBuf, cmd, cmd_len);
+	pDev->pOutputBuf[IRTOUCH_CMD_TAG_OFFSET] = pSlot->tag;
+	retval = irtouch_bulk_write_locked(pDev, cmd_len, BULK_TIMEOUT_WRITE);
+	mutex_unlock(&pDev->io_mutex_out);
+	if (retval < 0)
+		goto out;
+
+	deadline = jiffies + timeout;
+	retval = -ETIMEDOUT;
+	while (!completion_done(&pSlot->complete)) {
+		if (time_after_eq(jiffies, deadline))
+			break;
+		if (fatal_signal_pending(current)) {
+			retval = -EINTR;
+			break;
+		}
+		slice = min_t(long, deadline - jiffies, CMD_PUMP_TIMEOUT);
+		/* nobody is reading bulk-in, read it ourselves */
+		if (mutex_trylock(&pDev->io_mutex_bulk)) {
+			pumped = 0;
+			if (!completion_done(&pSlot->complete))
+				pumped = irtouch_cmd_pump(pDev, slice);
+			mutex_unlock(&pDev->io_mutex_bulk);
+			if (pumped == -ENODEV || pumped == -ESHUTDOWN) {
+				retval = pumped;
+				break;
+			}
+			/* a failing endpoint returns at once, leave it to the watchdog */
+			if (pumped < 0 && pumped != -ETIMEDOUT)
+				wait_for_completion_killable_timeout(&pSlot->complete, slice);
+		} else {
+			wait_for_completion_killable_timeout(&pSlot->complete, slice);
+		}
+	}
+
+out:
+	spin_lock_irq(&pDev->cmd_lock);
+	if (completion_done(&pSlot->complete))
+		retval = pSlot->resp_len;
+	pSlot->in_use = false;
+	spin_unlock_irq(&pDev->cmd_lock);
+	up(&pDev->cmd_sem);
+
+	return retval;
+}
+
+static long irtouch_ioctl_cmd(PTR_IRTOUCH_DEV_S pDev, struct irtouch_cmd __user *ucmd)
+{
+	struct irtouch_cmd cmd;
+	unsigned char *cmd_buf;
+	unsigned char *resp_buf;
+	long timeout;
+	u8 tag = 0;
+	int retval;
+
+	if (copy_from_user(&cmd, ucmd, sizeof(cmd)))
+		return -EFAULT;
+	if (!cmd.cmd_len || cmd.cmd_len > pDev->bulk_out_size || !cmd.resp_len
+		|| cmd.timeout_ms > IRTOUCH_XFER_MAX_TIMEOUT_MS)
+		return -EINVAL;
+	cmd.resp_len = min(cmd.resp_len, pDev->bulk_in_size);
+	timeout = cmd.timeout_ms ? msecs_to_jiffies(cmd.timeout_ms) : BULK_TIMEOUT_READ;
+
+	cmd_buf = memdup_user(u64_to_user_ptr(cmd.cmd), cmd.cmd_len);
+	if (IS_ERR(cmd_buf))
+		return PTR_ERR(cmd_buf);
+	resp_buf = kmalloc(cmd.resp_len, GFP_KERNEL);
+	if (!resp_buf) {
+		kfree(cmd_buf);
+		return -ENOMEM;
+	}
+
+	retval = irtouch_command(pDev, cmd_buf, cmd.cmd_len, resp_buf, cmd.resp_len, timeout, &tag);
+	if (retval >= 0) {
+		cmd.resp_len = retval;
+		cmd.tag = tag;
+		if (copy_to_user(u64_to_user_ptr(cmd.resp), resp_buf, retval)
+			|| copy_to_user(ucmd, &cmd, sizeof(cmd)))
+			retval = -EFAULT;
+	}
+	kfree(resp_buf);
+	kfree(cmd_buf);
+
+	return retval < 0 ? retval : 0;
+}
+
+//============================== scan governor START ===========================
+static int irtouch_scan_set_rate(PTR_IRTOUCH_DEV_S pDev, unsigned int rate)
+{
+	int retval;
+
+	mutex_lock(&pDev->io_mutex_out);
+	pDev->pOutputBuf[0] = IRTOUCH_CMD_REPORT_ID;
+	pDev->pOutputBuf[IRTOUCH_CMD_TAG_OFFSET] = IRTOUCH_CMD_TAG_INTERNAL;
+	pDev->pOutputBuf[2] = IRTOUCH_CMD_SET_SCAN_RATE;
+	put_unaligned_le16(rate, &pDev->pOutputBuf[3]);
+	retval = irtouch_bulk_write_locked(pDev, 5, BULK_TIMEOUT_WRITE);
+	mutex_unlock(&pDev->io_mutex_out);
+
+	return retval < 0 ? retval : 0;
+}
+
+/* called from the report path, cheap unless the panel is idling */
+static void irtouch_scan_activity(PTR_IRTOUCH_DEV_S pDev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pDev->scan_lock, flags);
+	pDev->scan_touch_jiffies = jiffies;
+	if (pDev->scan_state == SCAN_STATE_IDLE && !pDev->scan_stop)
+		mod_delayed_work(system_wq, &pDev->scan_work, 0);
+	spin_unlock_irqrestore(&pDev->scan_lock, flags);
+}
+
+static void irtouch_scan_check(struct work_struct *work)
+{
+	PTR_IRTOUCH_DEV_S pDev = container_of(to_delayed_work(work), IRTOUCH_DEV_S, scan_work);
+	unsigned long idle_timeout;
+	unsigned long next;
+	unsigned int rate;
+	int want;
+
+	spin_lock_irq(&pDev->scan_lock);
+	idle_timeout = msecs_to_jiffies(pDev->scan_idle_ms);
+	if (!pDev->scan_idle_ms || time_before(jiffies, pDev->scan_touch_jiffies + idle_timeout))
+		want = SCAN_STATE_ACTIVE;
+	else
+		want = SCAN_STATE_IDLE;
+	rate = want == SCAN_STATE_IDLE ? pDev->scan_rate_idle : pDev->scan_rate_active;
+	spin_unlock_irq(&pDev->scan_lock);
+
+	/* the bootloader doesn't scan */
+	if ((want != pDev->scan_state || rate != pDev->scan_rate_sent)
+		&& !atomic_read(&pDev->fw_active)
+		&& !irtouch_scan_set_rate(pDev, rate)) {
+		spin_lock_irq(&pDev->scan_lock);
+		pDev->scan_rate_sent = rate;
+		if (want != pDev->scan_state) {
+			pDev->scan_time_ms[pDev->scan_state] +=
+				jiffies_to_msecs(jiffies - pDev->scan_state_jiffies);
+			pDev->scan_state_jiffies = jiffies;
+			pDev->scan_state = want;
+			pDev->scan_switch_count++;
+		}
+		spin_unlock_irq(&pDev->scan_lock);
+		DBG_PRINTK("scan rate %u\n", rate);
+	}
+
+	spin_lock_irq(&pDev->scan_lock);
+	if (pDev->scan_state == SCAN_STATE_ACTIVE && pDev->scan_idle_ms
+		&& time_before(jiffies, pDev->scan_touch_jiffies + idle_timeout))
+		next = pDev->scan_touch_jiffies + idle_timeout - jiffies;
+	else
+		next = SCAN_IDLE_PERIOD;
+	if (!pDev->scan_stop)
+		mod_delayed_work(system_wq, &pDev->scan_work, next);
+	spin_unlock_irq(&pDev->scan_lock);
+}
+
+static void irtouch_scan_start(PTR_IRTOUCH_DEV_S pDev)
+{
+	spin_lock_irq(&pDev->scan_lock);
+	pDev->scan_state_jiffies = jiffies;
+#if USE_IRTOUCH_SCAN_GOVERNOR == 1
+	pDev->scan_stop = false;
+	pDev->scan_touch_jiffies = jiffies;
+	mod_delayed_work(system_wq, &pDev->scan_work, SCAN_IDLE_PERIOD);
+#else
+	/* nobody reports contacts, the idle rate would stick while touched */
+	pDev->scan_stop = true;
+#endif
+	spin_unlock_irq(&pDev->scan_lock);
+}
+
+/* the panel restarted at its default rate, scanning as if active */
+static void irtouch_scan_reset(PTR_IRTOUCH_DEV_S pDev)
+{
+	spin_lock_irq(&pDev->scan_lock);
+	if (pDev->scan_state != SCAN_STATE_ACTIVE) {
+		pDev->scan_time_ms[pDev->scan_state] +=
+			jiffies_to_msecs(jiffies - pDev->scan_state_jiffies);
+		pDev->scan_state_jiffies = jiffies;
+		pDev->scan_state = SCAN_STATE_ACTIVE;
+	}
+	pDev->scan_rate_sent = 0;
+	pDev->scan_touch_jiffies = jiffies;
+	if (!pDev->scan_stop)
+		mod_delayed_work(system_wq, &pDev->scan_work, 0);
+	spin_unlock_irq(&pDev->scan_lock);
+}
+
+static void irtouch_scan_stop(PTR_IRTOUCH_DEV_S pDev)
+{
+	spin_lock_irq(&pDev->scan_lock);
+	pDev->scan_stop = true;
+	spin_unlock_irq(&pDev->scan_lock);
+	cancel_delayed_work_sync(&pDev->scan_work);
+}
+
+static ssize_t get_scan_state(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+
+	if (!pDev)
+		return -ENODEV;
+	return sprintf(buf, "%s\n", pDev->scan_state == SCAN_STATE_IDLE ? "idle" : "active");
+}
+static struct device_attribute dev_attr_scan_state = __ATTR(state, 0444, get_scan_state, NULL);
+
+static ssize_t get_scan_time(PTR_IRTOUCH_DEV_S pDev, int state, char *buf)
+{
+	u64 ms;
+
+	spin_lock_irq(&pDev->scan_lock);
+	ms = pDev->scan_time_ms[state];
+	if (pDev->scan_state == state)
+		ms += jiffies_to_msecs(jiffies - pDev->scan_state_jiffies);
+	spin_unlock_irq(&pDev->scan_lock);
+
+	return sprintf(buf, "%llu\n", ms);
+}
+
+static ssize_t get_time_active_ms(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+
+	if (!pDev)
+		return -ENODEV;
+	return get_scan_time(pDev, SCAN_STATE_ACTIVE, buf);
+}
+static DEVICE_ATTR(time_active_ms, 0444, get_time_active_ms, NULL);
+
+static ssize_t get_time_idle_ms(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+
+	if (!pDev)
+		return -ENODEV;
+	return get_scan_time(pDev, SCAN_STATE_IDLE, buf);
+}
+static DEVICE_ATTR(time_idle_ms, 0444, get_time_idle_ms, NULL);
+
+IRTOUCH_COUNTER_ATTR(switch_count, scan_switch_count);
+
+#define IRTOUCH_SCAN_CONF_ATTR(_name, _field, _min, _max)						\
+static ssize_t get_##_name(struct device *dev,								\
+				struct device_attribute *attr, char *buf)				\
+{																			\
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));		\
+																			\
+	if (!pDev)																\
+		return -ENODEV;														\
+	return sprintf(buf, "%u\n", pDev->_field);								\
+}																			\
+static ssize_t set_##_name(struct device *dev,								\
+				struct device_attribute *attr, const char *buf, size_t count)	\
+{																			\
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));		\
+	unsigned int val;														\
+																			\
+	if (!pDev)																\
+		return -ENODEV;														\
+	if (kstrtouint(buf, 0, &val) || val < (_min) || val > (_max))			\
+		return -EINVAL;														\
+	spin_lock_irq(&pDev->scan_lock);										\
+	pDev->_field = val;														\
+	if (!pDev->scan_stop)													\
+		mod_delayed_work(system_wq, &pDev->scan_work, 0);					\
+	spin_unlock_irq(&pDev->scan_lock);										\
+	return count;															\
+}																			\
+static DEVICE_ATTR(_name, 0644, get_##_name, set_##_name)
+
+IRTOUCH_SCAN_CONF_ATTR(idle_timeout_ms, scan_idle_ms, 0, 24 * 3600 * 1000);
+IRTOUCH_SCAN_CONF_ATTR(rate_active, scan_rate_active, SCAN_RATE_MIN, 0xFFFF);
+IRTOUCH_SCAN_CONF_ATTR(rate_idle, scan_rate_idle, SCAN_RATE_MIN, 0xFFFF);
+
+static struct attribute *irtouch_scan_attrs[] = {
+	&dev_attr_scan_state.attr,
+	&dev_attr_time_active_ms.attr,
+	&dev_attr_time_idle_ms.attr,
+	&dev_attr_switch_count.attr,
+	&dev_attr_idle_timeout_ms.attr,
+	&dev_attr_rate_active.attr,
+	&dev_attr_rate_idle.attr,
+	NULL,
+};
+
+static const struct attribute_group irtouch_scan_group = {
+	.name	= "scan",
+	.attrs	= irtouch_scan_attrs,
+};
+//============================== scan governor END =============================
+
+#if USE_IRTOUCH_INPUT_DEVICE == 1 && USE_IRTOUCH_ALGO_TOUCH == 1
+static int irtouch_touch_send(PTR_IRTOUCH_DEV_S pDev, char *buffer, int length, ktime_t time)
+{
+#if USE_IRTOUCH_STITCH == 1
+	return irtouch_stitch_data_into_input(pDev->panel, buffer, length, time);
+#else
+	return irtouch_data_into_input(buffer, length, time);
+#endif
+}
+#endif
+
+#if USE_IRTOUCH_STITCH == 1
+static ssize_t get_stitch_geometry(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+	int x, y, w, h;
+
+	if (!pDev)
+		return -ENODEV;
+	irtouch_input_get_panel_geometry(pDev->panel, &x, &y, &w, &h);
+	return sprintf(buf, "%d %d %d %d\n", x, y, w, h);
+}
+
+/* "x y w h" of this panel in the 0..32767 global space */
+static ssize_t set_stitch_geometry(struct device *dev, struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+	int x, y, w, h;
+	int retval;
+
+	if (!pDev)
+		return -ENODEV;
+	if (sscanf(buf, "%d %d %d %d", &x, &y, &w, &h) != 4)
+		return -EINVAL;
+	retval = irtouch_input_set_panel_geometry(pDev->panel, x, y, w, h);
+	return retval ? retval : count;
+}
+static DEVICE_ATTR(geometry, 0644, get_stitch_geometry, set_stitch_geometry);
+
+static ssize_t get_stitch_panel(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+
+	if (!pDev)
+		return -ENODEV;
+	return sprintf(buf, "%d\n", pDev->panel);
+}
+static DEVICE_ATTR(panel, 0444, get_stitch_panel, NULL);
+
+static struct attribute *irtouch_stitch_attrs[] = {
+	&dev_attr_geometry.attr,
+	&dev_attr_panel.attr,
+	NULL,
+};
+
+static const struct attribute_group irtouch_stitch_group = {
+	.name	= "stitch",
+	.attrs	= irtouch_stitch_attrs,
+};
+#endif
+
+static int irtouch_ioctl_driver(void *pDEV, unsigned char *buffer, int length, unsigned char type)
+{
+	PTR_IRTOUCH_DEV_S pDev = (PTR_IRTOUCH_DEV_S)pDEV;
+	int retval = 0;
+
+	if (pDev == NULL) {
+		return -ENODEV;
+	}
+	
+	if (buffer == NULL) {
+		ERR_PRINTK("irtouch_ioctl_data buffer null\n");
+		return -ENOMEM;	 
+	}
+
+	/* touch is paused while the panel firmware is replaced, the poller sleeps */
+	if (atomic_read(&pDev->fw_active)
+		&& !wait_event_timeout(pDev->fw_wait, !atomic_read(&pDev->fw_active),
+					BULK_TIMEOUT_READ))
+		return -EBUSY;
+
+	switch(type) {
+		case DRIVER_IOCTL_TYPE_BULK_WRITE:
+			if (pDev->bulk_out_size < length)
+				return -EINVAL;
+			mutex_lock(&pDev->io_mutex_out);	
+			memcpy(pDev->pOutputBuf, buffer, length);
+			retval = irtouch_bulk_write_locked(pDev, length, BULK_TIMEOUT_WRITE);
+			mutex_unlock(&pDev->io_mutex_out);
+			break;
+		case DRIVER_IOCTL_TYPE_BULK_READ:
+			if (pDev->bulk_in_size < length)
+                                return -EINVAL;
+			mutex_lock(&pDev->io_mutex_bulk);	
+			retval = irtouch_bulk_read_locked(pDev, length, BULK_TIMEOUT_READ);
+			if (retval > 0)
+				memcpy(buffer, pDev->pInputBuf, retval);
+			mutex_unlock(&pDev->io_mutex_bulk);	
+			break;
+		case DRIVER_IOCTL_TYPE_TOUCH_SEND:
+#if USE_IRTOUCH_INPUT_DEVICE == 1 && USE_IRTOUCH_ALGO_TOUCH == 1
+			/* the touches come from the last frame the algo read */
+			retval = irtouch_touch_send(pDev, (char *)buffer, length, pDev->frame_time);
+			if (irtouch_input_contact_count())
+				irtouch_scan_activity(pDev);
+#endif
+			break;
+		default:
+			return -ENOTTY;
+	}
+
+	return retval;
+}
+
+//============================== firmware update START =========================
+static void irtouch_fw_out_callback(struct urb *urb)
+{
+	PTR_IRTOUCH_DEV_S pDev = urb->context;
+	int i;
+
+	if (urb->status && !pDev->fw_urb_status)
+		pDev->fw_urb_status = urb->status;
+	for (i = 0; i < IRTOUCH_FW_WINDOW; i++) {
+		if (pDev->fw_urb[i] == urb)
+			clear_bit(i, &pDev->fw_urb_busy);
+	}
+	wake_up(&pDev->fw_wait);
+}
+
+static void irtouch_fw_free_urbs(PTR_IRTOUCH_DEV_S pDev)
+{
+	int i;
+
+	for (i = 0; i < IRTOUCH_FW_WINDOW; i++) {
+		usb_free_urb(pDev->fw_urb[i]);
+		kfree(pDev->fw_buf[i]);
+		pDev->fw_urb[i] = NULL;
+		pDev->fw_buf[i] = NULL;
+	}
+}
+
+static int irtouch_fw_alloc_urbs(PTR_IRTOUCH_DEV_S pDev)
+{
+	int i;
+
+	for (i = 0; i < IRTOUCH_FW_WINDOW; i++) {
+		pDev->fw_urb[i] = usb_alloc_urb(0, GFP_KERNEL);
+		pDev->fw_buf[i] = kmalloc(pDev->bulk_out_size, GFP_KERNEL);
+		if (!pDev->fw_urb[i] || !pDev->fw_buf[i]) {
+			irtouch_fw_free_urbs(pDev);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static void irtouch_fw_header(unsigned char *pkt, u8 op, u32 offset)
+{
+	pkt[0] = IRTOUCH_CMD_REPORT_ID;
+	pkt[IRTOUCH_CMD_TAG_OFFSET] = IRTOUCH_CMD_TAG_INTERNAL;	/* matched by op and offset */
+	pkt[2] = op;
+	pkt[3] = 0;
+	put_unaligned_le32(offset, &pkt[4]);
+}
+
+/*
+ * Wait for the response to op. Touch data that is still in flight when the
+ * bootloader takes over is skipped. Returns the response length, the
+ * payload is left in pInputBuf.
+ */
+static int irtouch_fw_wait_resp(PTR_IRTOUCH_DEV_S pDev, u8 op, u32 offset, long timeout)
+{
+	unsigned long deadline = jiffies + timeout;
+	unsigned char *pkt = pDev->pInputBuf;
+	int retval;
+
+	for (;;) {
+		retval = irtouch_bulk_read_once(pDev, pDev->bulk_in_size, timeout, true);
+		if (retval < 0 && retval != -ETIMEDOUT)
+			return retval;
+		if (retval >= IRTOUCH_FW_HDR_SIZE && pkt[0] == IRTOUCH_CMD_REPORT_ID
+			&& pkt[2] == op && get_unaligned_le32(&pkt[4]) == offset) {
+			return pkt[3] ? -EIO : retval;
+		}
+		if (time_after_eq(jiffies, deadline))
+			return -ETIMEDOUT;
+		timeout = deadline - jiffies;
+	}
+}
+
+/* single command/response exchange, caller holds both bulk mutexes */
+static int irtouch_fw_request(PTR_IRTOUCH_DEV_S pDev, u8 op, u32 offset,
+			const unsigned char *payload, int length, long timeout)
+{
+	int retval;
+
+	irtouch_fw_header(pDev->pOutputBuf, op, offset);
+	if (length)
+		memcpy(pDev->pOutputBuf + IRTOUCH_FW_HDR_SIZE, payload, length);
+	retval = irtouch_bulk_write_locked(pDev, IRTOUCH_FW_HDR_SIZE + length, BULK_TIMEOUT_WRITE);
+	if (retval < 0)
+		return retval;
+	return irtouch_fw_wait_resp(pDev, op, offset, timeout);
+}
+
+static int irtouch_fw_submit_block(PTR_IRTOUCH_DEV_S pDev, const unsigned char *image,
+			u32 offset, int length)
+{
+	int slot;
+	int retval;
+
+	/* a free urb, the window itself is bounded by the acks */
+	retval = wait_event_killable(pDev->fw_wait,
+			pDev->fw_urb_status || (~pDev->fw_urb_busy & ((1UL << IRTOUCH_FW_WINDOW) - 1)));
+	if (retval)
+		return retval;
+	if (pDev->fw_urb_status)
+		return pDev->fw_urb_status;
+
+	slot = ffz(pDev->fw_urb_busy);
+	irtouch_fw_header(pDev->fw_buf[slot], IRTOUCH_FW_OP_DATA, offset);
+	memcpy(pDev->fw_buf[slot] + IRTOUCH_FW_HDR_SIZE, image + offset, length);
+	usb_fill_bulk_urb(pDev->fw_urb[slot],
+			pDev->udev,
+			usb_sndbulkpipe(pDev->udev, pDev->u8OutputEPAddr),
+			pDev->fw_buf[slot],
+			IRTOUCH_FW_HDR_SIZE + length,
+			irtouch_fw_out_callback,
+			pDev);
+	usb_anchor_urb(pDev->fw_urb[slot], &pDev->fw_anchor);
+	set_bit(slot, &pDev->fw_urb_busy);
+	retval = usb_submit_urb(pDev->fw_urb[slot], GFP_KERNEL);
+	if (retval) {
+		usb_unanchor_urb(pDev->fw_urb[slot]);
+		clear_bit(slot, &pDev->fw_urb_busy);
+		dev_err(&pDev->interface->dev, "%s - failed submitting fw urb, error %d\n",
+			__func__, retval);
+	}
+	return retval;
+}
+
+static int irtouch_fw_write(PTR_IRTOUCH_DEV_S pDev, const unsigned char *image, u32 size)
+{
+	u32 block = pDev->bulk_out_size - IRTOUCH_FW_HDR_SIZE;
+	u32 sent = 0;
+	u32 acked = 0;
+	int retval = 0;
+
+	pDev->fw_urb_busy = 0;
+	pDev->fw_urb_status = 0;
+
+	while (acked < size) {
+		/* keep the window full */
+		while (sent < size && sent - acked < IRTOUCH_FW_WINDOW * block) {
+			retval = irtouch_fw_submit_block(pDev, image, sent, min(block, size - sent));
+			if (retval)
+				goto out;
+			sent += min(block, size - sent);
+		}
+		/* blocks are acked in order */
+		retval = irtouch_fw_wait_resp(pDev, IRTOUCH_FW_OP_DATA, acked, IRTOUCH_FW_ACK_TIMEOUT);
+		if (retval < 0)
+			goto out;
+		acked += min(block, size - acked);
+		pDev->fw_done = acked;
+		pDev->fw_written = acked;
+	}
+	retval = 0;
+
+out:
+	if (retval)
+		usb_kill_anchored_urbs(&pDev->fw_anchor);
+	else
+		wait_event(pDev->fw_wait, !pDev->fw_urb_busy);
+	return retval ? retval : pDev->fw_urb_status;
+}
+
+static int irtouch_fw_verify(PTR_IRTOUCH_DEV_S pDev, const unsigned char *image, u32 size)
+{
+	u32 block = pDev->bulk_in_size - IRTOUCH_FW_HDR_SIZE;
+	u32 offset;
+	unsigned char length;
+	int retval;
+
+	block = min_t(u32, block, 255);
+	for (offset = 0; offset < size; offset += length) {
+		length = min(block, size - offset);
+		retval = irtouch_fw_request(pDev, IRTOUCH_FW_OP_READ, offset, &length, 1,
+					IRTOUCH_FW_ACK_TIMEOUT);
+		if (retval < 0)
+			return retval;
+		if (retval < IRTOUCH_FW_HDR_SIZE + length
+			|| memcmp(pDev->pInputBuf + IRTOUCH_FW_HDR_SIZE, image + offset, length)) {
+			dev_err(&pDev->interface->dev, "firmware verify failed at 0x%x\n", offset);
+			return -EIO;
+		}
+		pDev->fw_done = offset + length;
+	}
+	return 0;
+}
+
+static int irtouch_fw_update(PTR_IRTOUCH_DEV_S pDev, const unsigned char *image, u32 size, u32 flags)
+{
+	int retval;
+
+	if (atomic_cmpxchg(&pDev->fw_active, 0, 1))
+		return -EBUSY;
+
+#if USE_IRTOUCH_INPUT_DEVICE == 1
+	/* lift all contacts before the stream stops */
+	irtouch_input_release_all();
+#endif
+
+	mutex_lock(&pDev->io_mutex_bulk);
+	mutex_lock(&pDev->io_mutex_out);
+	if (!pDev->interface) {
+		retval = -ENODEV;
+		goto unlock;
+	}
+
+	retval = irtouch_fw_alloc_urbs(pDev);
+	if (retval)
+		goto unlock;
+
+	pDev->fw_state = FW_STATE_WRITING;
+	pDev->fw_error = 0;
+	pDev->fw_total = size;
+	pDev->fw_done = 0;
+	pDev->fw_written = 0;
+	pDev->fw_start_jiffies = jiffies;
+	pDev->fw_end_jiffies = 0;
+	kfifo_reset(&pDev->frame_fifo);
+	kfifo_reset(&pDev->frame_time_fifo);
+	dev_info(&pDev->interface->dev, "firmware update start, %u bytes\n", size);
+
+	retval = irtouch_fw_request(pDev, IRTOUCH_FW_OP_BEGIN, size, NULL, 0, IRTOUCH_FW_BEGIN_TIMEOUT);
+	if (retval >= 0)
+		retval = irtouch_fw_write(pDev, image, size);
+	pDev->fw_end_jiffies = jiffies;
+	if (!retval && (flags & IRTOUCH_FW_VERIFY)) {
+		pDev->fw_state = FW_STATE_VERIFYING;
+		pDev->fw_done = 0;
+		retval = irtouch_fw_verify(pDev, image, size);
+	}
+	/* END commits the image and restarts the scan */
+	if (!retval)
+		retval = irtouch_fw_request(pDev, IRTOUCH_FW_OP_END, size, NULL, 0, IRTOUCH_FW_BEGIN_TIMEOUT);
+	retval = retval < 0 ? retval : 0;
+
+	pDev->fw_error = retval;
+	pDev->fw_state = retval ? FW_STATE_FAILED : FW_STATE_DONE;
+	dev_info(&pDev->interface->dev, "firmware update %s (%d)\n",
+		retval ? "failed" : "done", retval);
+	irtouch_fw_free_urbs(pDev);
+
+unlock:
+	mutex_unlock(&pDev->io_mutex_out);
+	mutex_unlock(&pDev->io_mutex_bulk);
+
+	/* give the watchdog a fresh start, touch resumes on the next read */
+	spin_lock_irq(&pDev->health_lock);
+	pDev->err_burst = 0;
+	pDev->polling = false;
+	spin_unlock_irq(&pDev->health_lock);
+	atomic_set(&pDev->fw_active, 0);
+	wake_up_all(&pDev->fw_wait);
+	irtouch_scan_reset(pDev);
+
+	return retval;
+}
+
+static long irtouch_ioctl_fw_update(PTR_IRTOUCH_DEV_S pDev, struct irtouch_fw_update __user *ufw)
+{
+	struct irtouch_fw_update fw;
+	unsigned char *image;
+	long retval;
+
+	if (copy_from_user(&fw, ufw, sizeof(fw)))
+		return -EFAULT;
+	if (!fw.size || fw.size > IRTOUCH_FW_MAX_SIZE || (fw.flags & ~IRTOUCH_FW_VERIFY))
+		return -EINVAL;
+
+	image = vmalloc(fw.size);
+	if (!image)
+		return -ENOMEM;
+	if (copy_from_user(image, u64_to_user_ptr(fw.image), fw.size)) {
+		vfree(image);
+		return -EFAULT;
+	}
+
+	retval = irtouch_fw_update(pDev, image, fw.size, fw.flags);
+	vfree(image);
+
+	return retval;
+}
+
+static ssize_t get_fw_state(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+	static const char * const state_name[] = {
+		"idle", "writing", "verifying", "done", "failed",
+	};
+
+	if (!pDev)
+		return -ENODEV;
+	if (pDev->fw_state == FW_STATE_FAILED)
+		return sprintf(buf, "%s %d\n", state_name[pDev->fw_state], pDev->fw_error);
+	return sprintf(buf, "%s\n", state_name[pDev->fw_state]);
+}
+static struct device_attribute dev_attr_fw_state = __ATTR(state, 0444, get_fw_state, NULL);
+
+static ssize_t get_fw_progress(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+
+	if (!pDev)
+		return -ENODEV;
+	return sprintf(buf, "%u %u\n", pDev->fw_done, pDev->fw_total);
+}
+static struct device_attribute dev_attr_fw_progress = __ATTR(progress, 0444, get_fw_progress, NULL);
+
+/* bytes/s of the write phase, live while writing */
+static ssize_t get_fw_throughput(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(to_usb_interface(dev));
+	unsigned long end;
+	unsigned int ms;
+
+	if (!pDev)
+		return -ENODEV;
+	if (pDev->fw_state == FW_STATE_IDLE)
+		return sprintf(buf, "0\n");
+	end = pDev->fw_end_jiffies ? pDev->fw_end_jiffies : jiffies;
+	ms = jiffies_to_msecs(end - pDev->fw_start_jiffies);
+	return sprintf(buf, "%llu\n", ms ? div_u64((u64)pDev->fw_written * 1000, ms) : 0);
+}
+static struct device_attribute dev_attr_fw_throughput = __ATTR(throughput, 0444, get_fw_throughput, NULL);
+
+static struct attribute *irtouch_fw_attrs[] = {
+	&dev_attr_fw_state.attr,
+	&dev_attr_fw_progress.attr,
+	&dev_attr_fw_throughput.attr,
+	NULL,
+};
+
+static const struct attribute_group irtouch_fw_group = {
+	.name	= "firmware",
+	.attrs	= irtouch_fw_attrs,
+};
+//============================== firmware update END ===========================
+
+//============================== batched transfer START ========================
+static int irtouch_xfer_one(PTR_IRTOUCH_DEV_S pDev, struct irtouch_xfer_op *op)
+{
+	void __user *ubuf = u64_to_user_ptr(op->buf);
+	long timeout;
+	int retval;
+
+	if (op->timeout_ms > IRTOUCH_XFER_MAX_TIMEOUT_MS)
+		return -EINVAL;
+
+	switch (op->type) {
+		case IRTOUCH_XFER_BULK_WRITE:
+			if (!op->length || op->length > pDev->bulk_out_size)
+				return -EINVAL;
+			timeout = op->timeout_ms ? msecs_to_jiffies(op->timeout_ms) : BULK_TIMEOUT_WRITE;
+			if (mutex_lock_interruptible(&pDev->io_mutex_out))
+				return -EINTR;
+			if (!pDev->interface)
+				retval = -ENODEV;
+			else if (copy_from_user(pDev->pOutputBuf, ubuf, op->length))
+				retval = -EFAULT;
+			else
+				retval = irtouch_bulk_write_locked(pDev, op->length, timeout);
+			mutex_unlock(&pDev->io_mutex_out);
+			return retval;
+		case IRTOUCH_XFER_BULK_READ:
+			if (!op->length || op->length > pDev->bulk_in_size)
+				return -EINVAL;
+			timeout = op->timeout_ms ? msecs_to_jiffies(op->timeout_ms) : BULK_TIMEOUT_READ;
+			if (mutex_lock_interruptible(&pDev->io_mutex_bulk))
+				return -EINTR;
+			if (!pDev->interface)
+				retval = -ENODEV;
+			else
+				retval = irtouch_bulk_read_locked(pDev, op->length, timeout);
+			if (retval > 0 && copy_to_user(ubuf, pDev->pInputBuf, retval))
+				retval = -EFAULT;
+			mutex_unlock(&pDev->io_mutex_bulk);
+			return retval;
+		case IRTOUCH_XFER_TOUCH_SEND:
+#if USE_IRTOUCH_INPUT_DEVICE == 1 && USE_IRTOUCH_ALGO_TOUCH == 1
+		{
+			char packet[IRTOUCH_XFER_MAX_PACKET];
+
+			if (op->length > sizeof(packet))
+				return -EINVAL;
+			if (copy_from_user(packet, ubuf, op->length))
+				return -EFAULT;
+			retval = irtouch_touch_send(pDev, packet, op->length, ktime_get());
+			if (irtouch_input_contact_count())
+				irtouch_scan_activity(pDev);
+			return retval;
+		}
+#else
+			return -EOPNOTSUPP;
+#endif
+		case IRTOUCH_XFER_DELAY:
+			if (msleep_interruptible(op->timeout_ms))
+				return -EINTR;
+			return 0;
+		default:
+			return -ENOTTY;
+	}
+}
+
+static long irtouch_ioctl_xfer(PTR_IRTOUCH_DEV_S pDev, struct irtouch_xfer __user *uxfer)
+{
+	struct irtouch_xfer xfer;
+	struct irtouch_xfer_op *ops;
+	struct irtouch_xfer_op __user *uops;
+	unsigned long deadline;
+	long retval;
+	u32 i;
+
+	if (copy_from_user(&xfer, uxfer, sizeof(xfer)))
+		return -EFAULT;
+	if (!xfer.nr_ops || xfer.nr_ops > IRTOUCH_XFER_MAX_OPS)
+		return -EINVAL;
+	if (xfer.flags & ~IRTOUCH_XFER_STOP_ON_ERROR)
+		return -EINVAL;
+
+	uops = u64_to_user_ptr(xfer.ops);
+	ops = memdup_user(uops, xfer.nr_ops * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	/*
+	 * Locks are taken per op, so delays and writes don't hold off the touch
+	 * reader or the watchdog, and the whole batch is bounded in time.
+	 */
+	deadline = jiffies + msecs_to_jiffies(IRTOUCH_XFER_MAX_BATCH_MS);
+	for (i = 0; i < xfer.nr_ops; i++) {
+		if (!pDev->interface) {
+			ops[i].result = -ENODEV;
+		} else if (fatal_signal_pending(current)) {
+			ops[i].result = -EINTR;
+		} else if (time_after(jiffies, deadline)) {
+			ops[i].result = -ETIME;
+		} else {
+			ops[i].result = irtouch_xfer_one(pDev, &ops[i]);
+		}
+		if (ops[i].result < 0 && (ops[i].result == -ENODEV
+				|| ops[i].result == -EINTR
+				|| ops[i].result == -ETIME
+				|| (xfer.flags & IRTOUCH_XFER_STOP_ON_ERROR))) {
+			i++;
+			break;
+		}
+	}
+
+	/* tell userspace how many ops ran, each with its own result */
+	retval = i;
+	if (copy_to_user(uops, ops, i * sizeof(*ops)))
+		retval = -EFAULT;
+	kfree(ops);
+
+	return retval;
+}
+
+static long irtouch_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	PTR_IRTOUCH_DEV_S pDev = file->private_data;
+
+	if (atomic_read(&pDev->fw_active))
+		return -EBUSY;
+
+	switch (cmd) {
+		case IRTOUCH_IOC_XFER:
+			return irtouch_ioctl_xfer(pDev, (struct irtouch_xfer __user *)arg);
+		case IRTOUCH_IOC_CMD:
+			return irtouch_ioctl_cmd(pDev, (struct irtouch_cmd __user *)arg);
+		case IRTOUCH_IOC_FW_UPDATE:
+			return irtouch_ioctl_fw_update(pDev, (struct irtouch_fw_update __user *)arg);
+		default:
+			return -ENOTTY;
+	}
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0) && defined(CONFIG_COMPAT)
+/* every argument is a pointer to a layout-stable struct */
+static long irtouch_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	return irtouch_unlocked_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+//============================== batched transfer END ==========================
+
+static const struct file_operations irtouch_fops = {
+	.owner =	THIS_MODULE,
+	.open =		irtouch_open,
+	.release =	irtouch_release,
+	.unlocked_ioctl = irtouch_unlocked_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
+	.compat_ioctl =	compat_ptr_ioctl,
+#elif defined(CONFIG_COMPAT)
+	.compat_ioctl =	irtouch_compat_ioctl,
+#endif
+};
+
+/*
+ * usb class driver info in order to get a minor number from the usb core,
+ * and to have the device registered with the driver core
+ */
+static struct usb_class_driver irtouch_class = {
+	.name =		"irtouch-bulk%d",
+	.fops =		&irtouch_fops,
+	.minor_base =	180,
+};
+
+static void irtouch_delete(struct kref *kref)
+{
+	PTR_IRTOUCH_DEV_S  pDev	 = (PTR_IRTOUCH_DEV_S)container_of(kref, IRTOUCH_DEV_S, refcount);
+	
+	DBG_PRINTK("%s Line:%d", __func__, __LINE__);
+	
+	if (pDev->bulk_in_urb)
+	{
+		usb_kill_urb(pDev->bulk_in_urb);
+	}
+	
+	if (pDev->bulk_out_urb)
+	{
+		usb_kill_urb(pDev->bulk_out_urb);
+	}
+	
+	/* the last release() may come after disconnect, free before dropping udev */
+	if (pDev->pInputBuf)
+	{
+		usb_free_coherent(pDev->udev, pDev->bulk_in_size,
+                          pDev->pInputBuf, pDev->bulk_in_urb->transfer_dma);
+	}
+	
+	usb_free_urb(pDev->bulk_in_urb);
+	usb_free_urb(pDev->bulk_out_urb);
+	
+	if (pDev->udev)
+	{
+		usb_put_dev(pDev->udev);
+	}
+	
+	if (pDev->pOutputBuf)
+	{
+		kfree(pDev->pOutputBuf);
+	}
+	
+	kfree(pDev);
+	DBG_PRINTK("%s Line:%d", __func__, __LINE__);
+}
+
+static bool irtouch_is_touch_inf(struct usb_interface *interface)
+{
+	return interface->cur_altsetting->desc.bInterfaceNumber == USB_INF_NUM_TOUCH;
+}
+
+#if USE_IRTOUCH_CLAIM_TOUCH_INF == 1 && IRTOUCH_TOUCH_PATH == TOUCH_PATH_ALGO
+/*
+ * Take the HID touch interface of the same board. No urb is ever submitted
+ * on it, so the firmware's HID reports are not fetched or decoded at all.
+ */
+static void irtouch_claim_touch_inf(PTR_IRTOUCH_DEV_S pDev)
+{
+	struct usb_interface *pTouchInf = usb_ifnum_to_if(pDev->udev, USB_INF_NUM_TOUCH);
+	int retval;
+
+	if (!pTouchInf)
+		return;
+
+	/* usbhid usually wins the race at enumeration */
+	if (pTouchInf->dev.driver && pTouchInf->dev.driver != IRTOUCH_DRV(&irtouch_driver)) {
+		dev_info(&pTouchInf->dev, "taking touch interface over from %s\n",
+			pTouchInf->dev.driver->name);
+		device_release_driver(&pTouchInf->dev);
+	}
+
+	if (!usb_interface_claimed(pTouchInf)) {
+		retval = usb_driver_claim_interface(&irtouch_driver, pTouchInf, pDev);
+		if (retval) {
+			dev_err(&pTouchInf->dev, "can not claim touch interface, error %d\n", retval);
+			return;
+		}
+	} else {
+		/* already parked by irtouch_probe() */
+		usb_set_intfdata(pTouchInf, pDev);
+	}
+	pDev->touch_inf = pTouchInf;
+}
+#endif
+
+//==============================================================================
+static int irtouch_probe(struct usb_interface *interface,
+							const struct usb_device_id *id)
+{
+	PTR_IRTOUCH_DEV_S				   pDev		   = NULL;
+	struct usb_host_interface			*pInfDesc	= NULL;
+	struct usb_endpoint_descriptor		*pEndPoint	= NULL;
+	int retval										= -ENOMEM;
+	int i;
+	
+	DBG_PRINTK("%s Start!", __func__);
+
+	if (irtouch_is_touch_inf(interface)) {
+		/* parked, the algo interface links itself up in its own probe */
+		dev_info(&interface->dev, "HID touch interface parked, algo path reports touch\n");
+		return 0;
+	}
+	
+	/* allocate memory for our device state and initialize it */
 	pDev = kzalloc(sizeof(IRTOUCH_DEV_S), GFP_KERNEL);
 	if (!pDev)
 	{
@@ -414,9 +2072,29 @@ static int irtouch_probe(struct usb_interface *interface,
 	
 	kref_init(&pDev->refcount);
 	mutex_init(&pDev->io_mutex_bulk);
+	mutex_init(&pDev->io_mutex_out);
+
+	spin_lock_init(&pDev->cmd_lock);
+	sema_init(&pDev->cmd_sem, IRTOUCH_CMD_MAX_INFLIGHT);
+	for (i = 0; i < IRTOUCH_CMD_MAX_INFLIGHT; i++)
+		init_completion(&pDev->cmd_slot[i].complete);
+	INIT_KFIFO(pDev->frame_fifo);
+	INIT_KFIFO(pDev->frame_time_fifo);
+
+	init_usb_anchor(&pDev->fw_anchor);
+	init_waitqueue_head(&pDev->fw_wait);
+
+	spin_lock_init(&pDev->scan_lock);
+	INIT_DELAYED_WORK(&pDev->scan_work, irtouch_scan_check);
+	pDev->scan_idle_ms = SCAN_IDLE_TIMEOUT_MS;
+	pDev->scan_rate_active = SCAN_RATE_ACTIVE;
+	pDev->scan_rate_idle = SCAN_RATE_IDLE;
  
 	init_completion(&pDev->complete_read);
 	init_completion(&pDev->complete_write);
+
+	spin_lock_init(&pDev->health_lock);
+	INIT_DELAYED_WORK(&pDev->health_work, irtouch_health_check);
 	
 	// bind interface.
 	pDev->udev = usb_get_dev(interface_to_usbdev(interface));
@@ -490,27 +2168,85 @@ static int irtouch_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	retval = sysfs_create_group(&interface->dev.kobj, &irtouch_health_group);
+	if (retval) {
+		dev_err(&interface->dev, "Not able to create health sysfs group.\n");
+		goto health_error;
+	}
+	irtouch_health_start(pDev);
+
+	retval = sysfs_create_group(&interface->dev.kobj, &irtouch_fw_group);
+	if (retval) {
+		dev_err(&interface->dev, "Not able to create firmware sysfs group.\n");
+		goto fw_error;
+	}
+
+	retval = sysfs_create_group(&interface->dev.kobj, &irtouch_scan_group);
+	if (retval) {
+		dev_err(&interface->dev, "Not able to create scan sysfs group.\n");
+		goto scan_error;
+	}
+	irtouch_scan_start(pDev);
+
 	/* let the user know what node this device is now attached to */
 	dev_info(&interface->dev,
 		 "USB device now attached to USBirtouch-%d, drv ver:%s\n",
 		 interface->minor, DRIVER_VERSION);
 		
-#if USE_IRTOUCH_INPUT_DEVICE == 1
+#if USE_IRTOUCH_INPUT_DEVICE == 1 && USE_IRTOUCH_ALGO_TOUCH == 1
 	retval = irtouch_input_init();
 	if (retval) {
 		dev_err(&interface->dev, "input-dev can not init.\n");
 		goto input_error;
 	}
+#if USE_IRTOUCH_STITCH == 1
+	pDev->panel = irtouch_input_attach_panel();
+	if (pDev->panel < 0) {
+		dev_err(&interface->dev, "no free stitch panel.\n");
+		retval = pDev->panel;
+		goto panel_error;
+	}
+	retval = sysfs_create_group(&interface->dev.kobj, &irtouch_stitch_group);
+	if (retval) {
+		dev_err(&interface->dev, "Not able to create stitch sysfs group.\n");
+		irtouch_input_detach_panel(pDev->panel);
+		goto panel_error;
+	}
+#endif
+#endif
+
+#if USE_IRTOUCH_ALGO_DRIVER == 1 && USE_IRTOUCH_ALGO_TOUCH == 1
+	mutex_lock(&G_algo_lock);
+	if (!G_algo_owner) {
+		G_algo_owner = pDev;
+		InitIRTouchModule(irtouch_ioctl_driver, (void *)pDev);
+	} else {
+		dev_info(&interface->dev, "algo module already serves another board\n");
+	}
+	mutex_unlock(&G_algo_lock);
 #endif
 
-#if USE_IRTOUCH_ALGO_DRIVER == 1
-	InitIRTouchModule(irtouch_ioctl_driver, (void *)pDev);
+#if USE_IRTOUCH_CLAIM_TOUCH_INF == 1 && IRTOUCH_TOUCH_PATH == TOUCH_PATH_ALGO
+	irtouch_claim_touch_inf(pDev);
 #endif
 
 	return 0;
 
+#if USE_IRTOUCH_INPUT_DEVICE == 1 && USE_IRTOUCH_ALGO_TOUCH == 1 && USE_IRTOUCH_STITCH == 1
+panel_error:
+	irtouch_input_exit();
+#endif
 input_error:
+	irtouch_scan_stop(pDev);
+	sysfs_remove_group(&interface->dev.kobj, &irtouch_scan_group);
+scan_error:
+	sysfs_remove_group(&interface->dev.kobj, &irtouch_fw_group);
+fw_error:
+	irtouch_health_stop(pDev);
+	sysfs_remove_group(&interface->dev.kobj, &irtouch_health_group);
+health_error:
 	usb_deregister_dev(interface, &irtouch_class);
+	usb_set_intfdata(interface, NULL);
 error:
 	if (pDev)
 	{
@@ -527,15 +2263,46 @@ static void irtouch_disconnect(struct usb_interface *interface)
 	
 	DBG_PRINTK("%s Line:%d\n", __func__, __LINE__);
 
-#if USE_IRTOUCH_ALGO_DRIVER == 1
-	ExitIRTouchModule();
+	if (irtouch_is_touch_inf(interface)) {
+		pDev = usb_get_intfdata(interface);
+		usb_set_intfdata(interface, NULL);
+		if (pDev)
+			pDev->touch_inf = NULL;
+		return;
+	}
+
+	pDev = usb_get_intfdata(interface);
+
+#if USE_IRTOUCH_ALGO_DRIVER == 1 && USE_IRTOUCH_ALGO_TOUCH == 1
+	mutex_lock(&G_algo_lock);
+	if (G_algo_owner == pDev) {
+		ExitIRTouchModule();
+		G_algo_owner = NULL;
+	}
+	mutex_unlock(&G_algo_lock);
 #endif
 
-#if USE_IRTOUCH_INPUT_DEVICE == 1
+#if USE_IRTOUCH_INPUT_DEVICE == 1 && USE_IRTOUCH_ALGO_TOUCH == 1
+#if USE_IRTOUCH_STITCH == 1
+	sysfs_remove_group(&interface->dev.kobj, &irtouch_stitch_group);
+	irtouch_input_detach_panel(pDev->panel);
+#endif
 	irtouch_input_exit();
 #endif
 
-	pDev = usb_get_intfdata(interface);
+	/*
+	 * Unbind the touch interface, this clears pDev->touch_inf. usbhid is
+	 * not re-probed on it, the HID path stays off until a replug or a
+	 * manual bind through sysfs.
+	 */
+	if (pDev->touch_inf)
+		usb_driver_release_interface(&irtouch_driver, pDev->touch_inf);
+
+	irtouch_scan_stop(pDev);
+	irtouch_health_stop(pDev);
+	sysfs_remove_group(&interface->dev.kobj, &irtouch_scan_group);
+	sysfs_remove_group(&interface->dev.kobj, &irtouch_fw_group);
+	sysfs_remove_group(&interface->dev.kobj, &irtouch_health_group);
 	usb_set_intfdata(interface, NULL);
 
 	/* give back our minor */
@@ -543,7 +2310,9 @@ static void irtouch_disconnect(struct usb_interface *interface)
 	
 	/* prevent more I/O from starting */
 	mutex_lock(&pDev->io_mutex_bulk);
+	mutex_lock(&pDev->io_mutex_out);
 	pDev->interface = NULL;
+	mutex_unlock(&pDev->io_mutex_out);
 	mutex_unlock(&pDev->io_mutex_bulk);
 
 	/* decrement our usage count */
@@ -552,10 +2321,57 @@ static void irtouch_disconnect(struct usb_interface *interface)
 	dev_err(&interface->dev, "USB Mcutouch #%d now disconnected", minor);
 }
 
+static int irtouch_pre_reset(struct usb_interface *interface)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(interface);
+
+	if (irtouch_is_touch_inf(interface))
+		return 0;
+
+	/* held until post_reset(), no I/O may run while the device resets */
+	mutex_lock(&pDev->io_mutex_bulk);
+	mutex_lock(&pDev->io_mutex_out);
+	usb_kill_urb(pDev->bulk_in_urb);
+	usb_kill_urb(pDev->bulk_out_urb);
+
+	return 0;
+}
+
+static int irtouch_post_reset(struct usb_interface *interface)
+{
+	PTR_IRTOUCH_DEV_S pDev = usb_get_intfdata(interface);
+
+	if (irtouch_is_touch_inf(interface))
+		return 0;
+
+	reinit_completion(&pDev->complete_read);
+	reinit_completion(&pDev->complete_write);
+	pDev->bulk_in_filled = 0;
+	pDev->bulk_out_filled = 0;
+	kfifo_reset(&pDev->frame_fifo);
+	kfifo_reset(&pDev->frame_time_fifo);
+
+	spin_lock_irq(&pDev->health_lock);
+	pDev->halt_in = false;
+	pDev->halt_out = false;
+	pDev->err_burst = 0;
+	pDev->polling = false;
+	spin_unlock_irq(&pDev->health_lock);
+
+	mutex_unlock(&pDev->io_mutex_out);
+	mutex_unlock(&pDev->io_mutex_bulk);
+
+	irtouch_scan_reset(pDev);
+
+	return 0;
+}
+
 static struct usb_driver irtouch_driver = {
 	.name					= "seewo-irtouch",
 	.probe					= irtouch_probe,
 	.disconnect				= irtouch_disconnect,
+	.pre_reset				= irtouch_pre_reset,
+	.post_reset				= irtouch_post_reset,
 	.id_table				= irtouch_table,
 	.supports_autosuspend	= 1,
 };
@@ -571,12 +2387,18 @@ static ssize_t get_drvinfo(struct device_driver *_drv, char *_buf)
 #endif
 	return length;
 }
-static DRIVER_ATTR(drvinfo, 0440, get_drvinfo, NULL);
+/* DRIVER_ATTR is gone since 4.14 */
+static struct driver_attribute driver_attr_drvinfo = __ATTR(drvinfo, 0440, get_drvinfo, NULL);
 
 static int usb_driver_irtouch_init(struct usb_driver *driver) {
 	int retval;
+#if USE_IRTOUCH_INPUT_DEVICE == 1
+	/* touch works without the frame filter, don't fail the load for it */
+	if (irtouch_input_bpf_init())
+		printk("seewo-irtouch frame filter kfuncs can not register, filtering unavailable.\n");
+#endif
 	usb_register_driver(driver, THIS_MODULE, KBUILD_MODNAME);
-	retval = driver_create_file(&driver->drvwrap.driver, &driver_attr_drvinfo);
+	retval = driver_create_file(IRTOUCH_DRV(driver), &driver_attr_drvinfo);
         if (retval) {
 		printk("seewo-irtouch usb-driver create sys file error.\n");
 		return retval;
@@ -586,7 +2408,7 @@ static int usb_driver_irtouch_init(struct usb_driver *driver) {
 
 static void usb_driver_irtouch_exit(struct usb_driver *driver) {
 	/* remove driver attr file */
-        driver_remove_file(&driver->drvwrap.driver, &driver_attr_drvinfo);
+        driver_remove_file(IRTOUCH_DRV(driver), &driver_attr_drvinfo);
 	usb_deregister(driver);
 }
 module_driver(irtouch_driver, usb_driver_irtouch_init, usb_driver_irtouch_exit);
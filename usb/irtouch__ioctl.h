@@ -0,0 +1,79 @@
+#ifndef _IRTOUCH__IOCTL_H_
+#define _IRTOUCH__IOCTL_H_
+
+/*
+ * ioctls of /dev/irtouch-bulkN, shared by the driver and userspace tools.
+ * Pointers are passed as __u64 so 32-bit callers use the same layout.
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * IRTOUCH_IOC_XFER runs a vector of operations in one syscall, each op
+ * holding only the endpoint it uses. type is one of the IRTOUCH_XFER_*
+ * op types, timeout_ms = 0 selects the default bulk timeout. Every
+ * executed op gets its byte count or -errno in result, the ioctl returns
+ * the number of ops executed. A batch running past
+ * IRTOUCH_XFER_MAX_BATCH_MS stops with -ETIME in the first op not run.
+ */
+#define IRTOUCH_XFER_BULK_READ		0
+#define IRTOUCH_XFER_BULK_WRITE		1
+#define IRTOUCH_XFER_TOUCH_SEND		2		/* feed a touch packet to the input device */
+#define IRTOUCH_XFER_DELAY			0x10	/* sleep timeout_ms */
+#define IRTOUCH_XFER_STOP_ON_ERROR	0x01	/* xfer flags */
+#define IRTOUCH_XFER_MAX_OPS		1024
+#define IRTOUCH_XFER_MAX_TIMEOUT_MS	10000
+#define IRTOUCH_XFER_MAX_BATCH_MS	30000
+#define IRTOUCH_XFER_MAX_PACKET		64
+
+struct irtouch_xfer_op
+{
+	__u32	type;
+	__u32	length;			/* buffer length */
+	__u32	timeout_ms;
+	__s32	result;			/* out: bytes transferred or -errno */
+	__u64	buf;			/* user pointer */
+};
+
+struct irtouch_xfer
+{
+	__u32	nr_ops;
+	__u32	flags;
+	__u64	ops;			/* user pointer to struct irtouch_xfer_op[nr_ops] */
+};
+
+/*
+ * IRTOUCH_IOC_CMD sends cmd, the tag byte is filled in by the driver, and
+ * waits for the firmware response carrying the same tag. resp_len returns
+ * the response length.
+ */
+struct irtouch_cmd
+{
+	__u32	cmd_len;
+	__u32	resp_len;		/* in: resp buffer size, out: response length */
+	__u32	timeout_ms;
+	__u32	tag;			/* out: tag used for this command */
+	__u64	cmd;			/* user pointer */
+	__u64	resp;			/* user pointer */
+};
+
+/*
+ * IRTOUCH_IOC_FW_UPDATE flashes a whole image, touch is paused meanwhile.
+ * With IRTOUCH_FW_VERIFY the image is read back before it is committed.
+ */
+#define IRTOUCH_FW_VERIFY			0x01	/* fw_update flags */
+#define IRTOUCH_FW_MAX_SIZE			(4 << 20)
+
+struct irtouch_fw_update
+{
+	__u64	image;			/* user pointer */
+	__u32	size;
+	__u32	flags;
+};
+
+#define IRTOUCH_IOC_MAGIC	'I'
+#define IRTOUCH_IOC_XFER	_IOWR(IRTOUCH_IOC_MAGIC, 0x01, struct irtouch_xfer)
+#define IRTOUCH_IOC_CMD		_IOWR(IRTOUCH_IOC_MAGIC, 0x02, struct irtouch_cmd)
+#define IRTOUCH_IOC_FW_UPDATE	_IOW(IRTOUCH_IOC_MAGIC, 0x03, struct irtouch_fw_update)
+
+#endif